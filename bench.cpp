@@ -0,0 +1,145 @@
+// Microbenchmark of the cost kernels in kernels.hpp against the original
+// two-pointer merge, and of the prefix sum kernels. Checks that all kernels
+// give the same results.
+//   ./kernelbench [pairs per distribution]
+#include "kernels.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+#include <set>
+
+// The merge loop previously used by Solvers::calculateCostDiff
+CostPair costPairReference(const std::vector<int> &ai, const std::vector<int> &aj) {
+  long long c1 = 0, c2 = 0;
+  auto itj = aj.begin();
+
+  for(auto iti = ai.begin(); iti != ai.end(); ++iti) {
+    bool first = true;
+    for(; itj != aj.end(); ++itj) {
+      if(first && *itj >= *iti) {
+        c2 += itj - aj.begin();
+        first = false;
+      }
+      if(*itj > *iti) {
+        c1 += aj.end() - itj;
+        break;
+      }
+    }
+    if(first)
+      c2 += aj.size();
+  }
+
+  return {c1, c2};
+}
+
+std::vector<int> randomList(std::mt19937 &rgen, int degree, int center, int spread) {
+  std::set<int> s;
+  std::uniform_int_distribution<> distrib(std::max(0, center - spread), center + spread);
+  while((int)s.size() < degree)
+    s.insert(distrib(rgen));
+  return std::vector<int>(s.begin(), s.end());
+}
+
+template<class T, class F>
+double timeKernel(const std::vector<std::pair<std::vector<T>,std::vector<T>>> &pairs, F kernel, long long &checksum) {
+  auto t0 = std::chrono::high_resolution_clock::now();
+  for(int rep = 0; rep < 5; rep++) {
+    for(auto &[a, b] : pairs) {
+      CostPair p = kernel(a, b);
+      checksum += p.c1 - 3 * p.c2;
+    }
+  }
+  auto t1 = std::chrono::high_resolution_clock::now();
+  return std::chrono::duration<double>(t1 - t0).count();
+}
+
+int main(int argc, char **argv) {
+  int npairs = argc >= 2 ? atoi(argv[1]) : 200000;
+  std::mt19937 rgen(1);
+
+  struct Distribution {
+    const char *name;
+    int da, db, spread;
+  };
+  std::vector<Distribution> distributions = {
+    {"deg 4 vs 4", 4, 4, 20},
+    {"deg 16 vs 16", 16, 16, 60},
+    {"deg 64 vs 64", 64, 64, 200},
+    {"deg 512 vs 512", 512, 512, 2000},
+    {"deg 16 vs 2048", 16, 2048, 8000},
+    {"deg 1 vs 4096", 1, 4096, 10000},
+  };
+
+  printf("%-16s %10s %10s %10s %10s %10s %10s\n", "distribution", "reference", "scalar", "gallop", "avx2", "costPair", "16 bits");
+  for(auto &d : distributions) {
+    std::vector<std::pair<std::vector<int>,std::vector<int>>> pairs;
+    int n = std::max(1, npairs * 16 / (d.da + d.db));
+    for(int k = 0; k < n; k++) {
+      int center = d.spread + rgen() % 1000;
+      pairs.push_back(std::make_pair(randomList(rgen, d.da, center, d.spread),
+                                     randomList(rgen, d.db, center + (int)(rgen() % d.spread) - d.spread / 2, d.spread)));
+    }
+
+    for(auto &[a, b] : pairs) {
+      CostPair r = costPairReference(a, b);
+      std::vector<uint16_t> a16(a.begin(), a.end()), b16(b.begin(), b.end());
+      CostPair ps[] = {costPairScalar(a.data(), a.size(), b.data(), b.size()),
+                       costPairGallop(a.data(), a.size(), b.data(), b.size()),
+                       __builtin_cpu_supports("avx2") ? costPairAvx2(a.data(), a.size(), b.data(), b.size()) : r,
+                       costPair(a.data(), a.size(), b.data(), b.size()),
+                       costPair(a16.data(), a16.size(), b16.data(), b16.size()),
+                       costPairRepeated(a.data(), a.size(), b.data(), b.size())};
+      for(auto &p : ps) {
+        if(p.c1 != r.c1 || p.c2 != r.c2) {
+          printf("Mismatch on %s: expected %lld %lld, got %lld %lld\n", d.name, r.c1, r.c2, p.c1, p.c2);
+          return 1;
+        }
+      }
+    }
+
+    std::vector<std::pair<std::vector<uint16_t>,std::vector<uint16_t>>> pairs16;
+    for(auto &[a, b] : pairs)
+      pairs16.push_back(std::make_pair(std::vector<uint16_t>(a.begin(), a.end()), std::vector<uint16_t>(b.begin(), b.end())));
+
+    long long checksum = 0;
+    double tr = timeKernel(pairs, [](auto &a, auto &b) { return costPairReference(a, b); }, checksum);
+    double ts = timeKernel(pairs, [](auto &a, auto &b) { return costPairScalar(a.data(), a.size(), b.data(), b.size()); }, checksum);
+    double tg = timeKernel(pairs, [](auto &a, auto &b) { return costPairGallop(a.data(), a.size(), b.data(), b.size()); }, checksum);
+    double t2 = __builtin_cpu_supports("avx2") ? timeKernel(pairs, [](auto &a, auto &b) { return costPairAvx2(a.data(), a.size(), b.data(), b.size()); }, checksum) : 0;
+    double tc = timeKernel(pairs, [](auto &a, auto &b) { return costPair(a.data(), a.size(), b.data(), b.size()); }, checksum);
+    double t16 = timeKernel(pairs16, [](auto &a, auto &b) { return costPair(a.data(), a.size(), b.data(), b.size()); }, checksum);
+    printf("%-16s %9.1fx %9.1fx %9.1fx %9.1fx %9.1fx %9.1fx   (reference %.3f s, checksum %lld)\n", d.name,
+           1.0, tr / ts, tr / tg, t2 > 0 ? tr / t2 : 0, tr / tc, tr / t16, tr, checksum);
+  }
+
+  // Prefix sums and maximum, as used to pick the jump positions
+  std::uniform_int_distribution<> gain(-1000, 1000);
+  double tps = 0, tpv = 0;
+  long long checksum = 0;
+  for(int len : {0, 1, 3, 4, 7, 64, 1000, 5000}) {
+    std::vector<long long> a(len);
+    for(auto &x : a)
+      x = gain(rgen);
+    std::vector<long long> s = a, v = a;
+    long long ms = prefixSumMaxScalar(s.data(), len), mv = prefixSumMax(v.data(), len);
+    if(ms != mv || s != v) {
+      printf("Mismatch on prefix sums of length %d\n", len);
+      return 1;
+    }
+    for(int rep = 0; rep < npairs / 100; rep++) {
+      auto t0 = std::chrono::high_resolution_clock::now();
+      s = a;
+      checksum += prefixSumMaxScalar(s.data(), len);
+      auto t1 = std::chrono::high_resolution_clock::now();
+      v = a;
+      checksum += prefixSumMax(v.data(), len);
+      auto t2 = std::chrono::high_resolution_clock::now();
+      tps += std::chrono::duration<double>(t1 - t0).count();
+      tpv += std::chrono::duration<double>(t2 - t1).count();
+    }
+  }
+  printf("%-16s %9.1fx %9.1fx   (scalar %.3f s, checksum %lld)\n", "prefix sums", 1.0, tps / tpv, tps, checksum);
+  return 0;
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include "instance.hpp"
+
+// Decomposition of v1 into blocks that can be solved independently. If all
+// neighbors of a block come before (or at) all neighbors of the next block,
+// no edge of one crosses an edge of the other when the blocks are placed one
+// after the other, which is therefore optimal. Blocks smaller than minSize
+// are grouped with the next ones, to avoid many tiny independent problems.
+struct Blocks {
+  std::vector<std::vector<int>> vertices; // Vertices of each block, by front
+  std::vector<int> of; // Block of each bottom vertex (-1 if not in v1)
+
+  Blocks() {}
+
+  Blocks(const Instance &inst, int minSize) : of(inst.n1, -1) {
+    std::vector<int> byFront(inst.v1);
+    std::sort(byFront.begin(), byFront.end(), [&inst](int a, int b) {
+      const auto &ba = inst.bottom[a], &bb = inst.bottom[b];
+      return ba.front != bb.front ? ba.front < bb.front : ba.back < bb.back;
+    });
+
+    int maxBack = -1;
+    for(int i : byFront) {
+      // Cut if everything so far ends before i starts
+      if(vertices.empty() || (maxBack <= inst.bottom[i].front && (int)vertices.back().size() >= minSize))
+        vertices.emplace_back();
+      vertices.back().push_back(i);
+      maxBack = std::max(maxBack, inst.bottom[i].back);
+    }
+
+    for(int b = 0; b < (int)vertices.size(); b++)
+      for(int i : vertices[b])
+        of[i] = b;
+  }
+
+  int size() const {
+    return vertices.size();
+  }
+};
@@ -0,0 +1,78 @@
+#pragma once
+#include "solvers.hpp"
+#include <unordered_map>
+#include <functional>
+
+// Improvement of the pairwise lower bound by 3-cycles. Each pair costs at
+// least the smaller of its two costs, and the excess over it is the absolute
+// cost difference of the pair. If the cheaper orders of the pairs of a triple
+// form a cycle, any order pays the excess of at least one of them, so the
+// smallest of the three can be added to the bound. Triples are packed
+// greedily: the excess of each pair can be shared by several triples, as long
+// as the sum of what they add is at most the excess (the residual is kept in
+// a hash map). Only triples of pairwise overlapping neighbor intervals are
+// enumerated, by increasing front. Returns the amount added to the bound, and
+// calls poll with it from time to time, stopping if poll returns false.
+template<class S>
+i64 triangleBound(S &solvers, const Order &vertices, std::function<bool(i64)> poll) {
+  static constexpr size_t maxResiduals = 1 << 22; // Entries of the map (about 150 MB)
+  static constexpr int pollTriples = 1 << 16;
+
+  Order byFront(vertices);
+  std::sort(byFront.begin(), byFront.end(), [](int a, int b) {
+    return instance.bottom[a].front < instance.bottom[b].front;
+  });
+  auto overlap = [](int a, int b) { // With front a <= front b
+    return instance.bottom[b].front < instance.bottom[a].back;
+  };
+
+  std::unordered_map<uint64_t,i64> residuals;
+  // Residual excess of the pair, and the sign of its difference (positive if
+  // a before b is cheaper)
+  auto residual = [&](int a, int b, auto &guard, int &sign) -> i64* {
+    i64 d = solvers.costDiff(a, b, guard);
+    sign = (d > 0) - (d < 0);
+    uint64_t key = a < b ? (uint64_t)a << 32 | b : (uint64_t)b << 32 | a;
+    auto it = residuals.find(key);
+    if(it == residuals.end()) {
+      if(residuals.size() >= maxResiduals)
+        return nullptr;
+      it = residuals.emplace(key, d < 0 ? -d : d).first;
+    }
+    return &it->second;
+  };
+
+  i64 added = 0;
+  int n = byFront.size(), count = 0;
+  for(int i = 0; i < n; i++) {
+    auto guard = solvers.guard();
+    int u = byFront[i];
+    for(int j = i + 1; j < n && overlap(u, byFront[j]); j++) {
+      int v = byFront[j], suv;
+      i64 *ruv = residual(u, v, guard, suv);
+      if(ruv == nullptr)
+        return added;
+      for(int k = j + 1; k < n && overlap(u, byFront[k]) && *ruv > 0 && suv != 0; k++) {
+        if(++count % pollTriples == 0 && !poll(added))
+          return added;
+        int w = byFront[k];
+        if(!overlap(v, w))
+          continue;
+        int svw, swu;
+        i64 *rvw = residual(v, w, guard, svw);
+        i64 *rwu = residual(w, u, guard, swu);
+        if(rvw == nullptr || rwu == nullptr)
+          return added;
+        if(svw != suv || swu != suv) // Not a cycle
+          continue;
+        i64 p = std::min({*ruv, *rvw, *rwu});
+        *ruv -= p;
+        *rvw -= p;
+        *rwu -= p;
+        added += p;
+      }
+    }
+  }
+  poll(added);
+  return added;
+}
@@ -1,3 +1,3 @@
 #!/bin/bash
-g++ -Ofast -std=c++20 -march=native -mtune=native -funroll-loops -finline-functions -o heuristic main.cpp
-g++ -Ofast -std=c++20 -march=native -mtune=native -funroll-loops -finline-functions -D EXACT -o exact main.cpp
+g++ -Ofast -std=c++20 -march=native -mtune=native -funroll-loops -finline-functions -pthread -o heuristic main.cpp
+g++ -Ofast -std=c++20 -march=native -mtune=native -funroll-loops -finline-functions -pthread -D EXACT -o exact main.cpp
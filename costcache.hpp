@@ -0,0 +1,391 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <limits>
+#include <cstdint>
+#include <utility>
+#include <cassert>
+#include <cstdlib>
+#include <iostream>
+
+// Small dense index for the calling thread, used to address per-thread slots.
+// The index of a thread is reused by later threads once it exits.
+constexpr int maxThreads = 1024;
+
+inline std::atomic<int> threadCount = 0; // Indices ever handed out
+inline std::mutex threadIndexMutex; // Protects freeThreadIndices
+inline std::vector<int> freeThreadIndices;
+
+class ThreadIndex {
+public:
+  int index;
+
+  ThreadIndex() {
+    std::lock_guard lock(threadIndexMutex);
+    if(!freeThreadIndices.empty()) {
+      index = freeThreadIndices.back();
+      freeThreadIndices.pop_back();
+    }
+    else if(threadCount < maxThreads)
+      index = threadCount++;
+    else {
+      std::cerr << "More than " << maxThreads << " threads use the matrix at once" << std::endl;
+      abort();
+    }
+  }
+
+  ~ThreadIndex() {
+    std::lock_guard lock(threadIndexMutex);
+    freeThreadIndices.push_back(index);
+  }
+};
+
+inline int threadIndex() {
+  thread_local ThreadIndex t;
+  return t.index;
+}
+
+struct CacheStats {
+  uint64_t hits = 0, misses = 0;
+  size_t bytes = 0, tiles = 0;
+
+  double hitRate() const {
+    return hits + misses == 0 ? 0.0 : (double) hits / (hits + misses);
+  }
+};
+
+// Cache of pairwise cost differences, split into square tiles that are
+// allocated the first time one of their pairs is stored. Both (i,j) and (j,i)
+// are stored, so that all entries of a fixed j are contiguous within a tile.
+// When the memory budget is reached, a missing tile replaces a resident one
+// only if it was asked for more often than the resident one was used
+// (frequency counts that are halved periodically), which avoids thrashing
+// when the working set does not fit. Evicted tiles are freed only once every thread that could still
+// read them has left its Guard (epoch-based reclamation), so lookups need no
+// locks.
+template<class DTM>
+class CostCache {
+  static constexpr DTM empty = std::numeric_limits<DTM>::max();
+  static constexpr uint64_t offline = std::numeric_limits<uint64_t>::max();
+  static constexpr size_t maxRetired = 64; // Do not allocate while so many tiles wait to be freed
+  static constexpr unsigned char admitDemand = 8; // Requests for a missing tile before trying to evict another one
+  static constexpr int victimCandidates = 8;
+  inline static DTM notLoaded = 0; // Address marking the tiles a Column did not load
+
+  struct alignas(64) Slot {
+    std::atomic<uint64_t> epoch = offline;
+    std::atomic<uint64_t> hits = 0, misses = 0;
+    int depth = 0; // Only touched by the owner thread
+  };
+
+  int n = 0, nt = 0;
+  int tileBits = 7, tileMask = 0;
+  size_t tileEntries = 0, tileBytes = 0, ntiles = 0;
+  size_t memlimit = 0;
+  std::unique_ptr<std::atomic<DTM*>[]> dir;
+  std::unique_ptr<std::atomic<unsigned char>[]> freq; // Uses of resident tiles, requests for missing ones
+  std::unique_ptr<Slot[]> slots;
+  std::atomic<uint64_t> epoch = 1;
+  std::atomic<size_t> bytes = 0;
+  std::atomic<bool> full = false;
+
+  std::mutex allocMutex; // Protects everything below
+  std::vector<size_t> resident;
+  size_t hand = 0;
+  size_t attempts = 0; // Eviction attempts since the counts were last halved
+  std::vector<std::pair<DTM*,uint64_t>> retired;
+
+public:
+  // Marks the calling thread as a reader. Tile pointers loaded inside the
+  // guard stay valid until the outermost guard of the thread is destroyed.
+  class Guard {
+    CostCache &cache;
+    Slot &slot;
+    uint64_t hits = 0, misses = 0;
+
+  public:
+    Guard(CostCache &c) : cache(c), slot(c.slots[threadIndex()]) {
+      if(slot.depth++ == 0) {
+        slot.epoch.store(cache.epoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+      }
+    }
+
+    ~Guard() {
+      slot.hits.store(slot.hits.load(std::memory_order_relaxed) + hits, std::memory_order_relaxed);
+      slot.misses.store(slot.misses.load(std::memory_order_relaxed) + misses, std::memory_order_relaxed);
+      if(--slot.depth == 0)
+        slot.epoch.store(offline, std::memory_order_release);
+    }
+
+    void count(uint64_t h, uint64_t m) {
+      hits += h;
+      misses += m;
+    }
+  };
+
+  // Tile pointers of a Column, reused by the columns of a thread. Entries
+  // that were not loaded point to notLoaded.
+  struct ColumnTiles {
+    std::vector<DTM*> tiles;
+    std::vector<int> loaded;
+    bool busy = false;
+  };
+
+  // The entries (i,j) for a fixed j, for loops comparing many vertices with
+  // one vertex. The pointer of each tile of the column is loaded (and its use
+  // counted) the first time it is needed, so a column costs in proportion to
+  // the tiles read. Must be used inside a Guard.
+  class Column {
+    CostCache &cache;
+    Guard &guard;
+    int j, bits, mask;
+    size_t base, t0;
+    ColumnTiles own; // Only if the buffer given is used by another column
+    ColumnTiles *buf;
+    uint64_t lookups = 0, misses = 0;
+
+    DTM *tile(int ti) {
+      DTM *&tile = buf->tiles[ti];
+      if(tile == &notLoaded) {
+        tile = cache.dir[t0 + ti].load(std::memory_order_acquire);
+        cache.bump(t0 + ti);
+        buf->loaded.push_back(ti);
+      }
+      return tile;
+    }
+
+  public:
+    Column(CostCache &c, int _j, Guard &g, ColumnTiles &tiles) : cache(c), guard(g), j(_j), bits(c.tileBits), mask(c.tileMask), buf(tiles.busy ? &own : &tiles) {
+      base = (size_t)(j & mask) << bits;
+      t0 = (size_t)(j >> bits) * cache.nt;
+      buf->busy = true;
+      if((int)buf->tiles.size() < cache.nt)
+        buf->tiles.resize(cache.nt, &notLoaded);
+    }
+
+    Column(const Column &) = delete;
+
+    ~Column() {
+      guard.count(lookups - misses, misses);
+      for(int ti : buf->loaded)
+        buf->tiles[ti] = &notLoaded;
+      buf->loaded.clear();
+      buf->busy = false;
+    }
+
+    bool lookup(int i, DTM &x) {
+      lookups++;
+      DTM *t = tile(i >> bits);
+      if(t != nullptr) {
+        DTM y = std::atomic_ref<DTM>(t[base | (i & mask)]).load(std::memory_order_relaxed);
+        if(y != empty) {
+          x = y;
+          return true;
+        }
+      }
+      misses++;
+      return false;
+    }
+
+    void store(int i, DTM x) {
+      cache.store(i, j, x);
+      tile(i >> bits);
+      buf->tiles[i >> bits] = cache.dir[cache.tileId(i, j)].load(std::memory_order_acquire);
+    }
+  };
+
+  CostCache(int _n, size_t _memlimit) : n(_n), memlimit(_memlimit) {
+    // Grow the tiles until the directory takes a small part of the memory
+    while(true) {
+      nt = ((n - 1) >> tileBits) + 1;
+      ntiles = (size_t)nt * nt;
+      if(ntiles * (sizeof(DTM*) + 1) <= memlimit / 64 || tileBits >= 12)
+        break;
+      tileBits++;
+    }
+    tileMask = (1 << tileBits) - 1;
+    tileEntries = (size_t)1 << (2 * tileBits);
+    tileBytes = tileEntries * sizeof(DTM);
+
+    dir.reset(new std::atomic<DTM*>[ntiles]);
+    freq.reset(new std::atomic<unsigned char>[ntiles]);
+    for(size_t t = 0; t < ntiles; t++) {
+      dir[t].store(nullptr, std::memory_order_relaxed);
+      freq[t].store(0, std::memory_order_relaxed);
+    }
+    slots.reset(new Slot[maxThreads]);
+    bytes = ntiles * (sizeof(DTM*) + 1);
+  }
+
+  ~CostCache() {
+    for(size_t t = 0; t < ntiles; t++)
+      delete[] dir[t].load();
+    for(auto [tile,_] : retired)
+      delete[] tile;
+  }
+
+  Guard guard() {
+    return Guard(*this);
+  }
+
+  // Must be called inside a Guard
+  bool lookup(int i, int j, DTM &x, Guard &g) {
+    size_t t = tileId(i, j);
+    DTM *tile = dir[t].load(std::memory_order_acquire);
+    bump(t);
+    if(tile != nullptr) {
+      DTM y = std::atomic_ref<DTM>(tile[offset(i, j)]).load(std::memory_order_relaxed);
+      if(y != empty) {
+        g.count(1, 0);
+        x = y;
+        return true;
+      }
+    }
+    g.count(0, 1);
+    return false;
+  }
+
+  // Stores x for (i,j) and -x for (j,i). Must be called inside a Guard.
+  // Silently drops the values if no memory is available.
+  void store(int i, int j, DTM x) {
+    storeOne(i, j, x);
+    storeOne(j, i, -x);
+  }
+
+  // True once the memory limit was reached
+  bool isFull() const {
+    return full.load(std::memory_order_relaxed);
+  }
+
+  // Lookups of the calling thread only, for its outermost guards so far
+  CacheStats threadStats() const {
+    const Slot &slot = slots[threadIndex()];
+    CacheStats s;
+    s.hits = slot.hits.load(std::memory_order_relaxed);
+    s.misses = slot.misses.load(std::memory_order_relaxed);
+    return s;
+  }
+
+  CacheStats stats() const {
+    CacheStats s;
+    for(int k = 0; k < std::min((int)threadCount, maxThreads); k++) {
+      s.hits += slots[k].hits.load(std::memory_order_relaxed);
+      s.misses += slots[k].misses.load(std::memory_order_relaxed);
+    }
+    s.bytes = bytes;
+    s.tiles = (s.bytes - ntiles * (sizeof(DTM*) + 1)) / tileBytes;
+    return s;
+  }
+
+protected:
+  size_t tileId(int i, int j) const {
+    return (size_t)(j >> tileBits) * nt + (i >> tileBits);
+  }
+
+  size_t offset(int i, int j) const {
+    return ((size_t)(j & tileMask) << tileBits) | (i & tileMask);
+  }
+
+  // Racy saturating increment, the counts are only a hint
+  void bump(size_t t) {
+    unsigned char f = freq[t].load(std::memory_order_relaxed);
+    if(f < 255)
+      freq[t].store(f + 1, std::memory_order_relaxed);
+  }
+
+  void storeOne(int i, int j, DTM x) {
+    size_t t = tileId(i, j);
+    DTM *tile = dir[t].load(std::memory_order_acquire);
+    if(tile == nullptr) {
+      if(full.load(std::memory_order_relaxed) && freq[t].load(std::memory_order_relaxed) < admitDemand)
+        return;
+      if((tile = allocate(t)) == nullptr)
+        return;
+    }
+    std::atomic_ref<DTM>(tile[offset(i, j)]).store(x, std::memory_order_relaxed);
+  }
+
+  DTM *allocate(size_t t) {
+    std::lock_guard lock(allocMutex);
+    DTM *tile = dir[t].load(std::memory_order_acquire);
+    if(tile != nullptr)
+      return tile; // Another thread was faster
+
+    if(bytes + tileBytes > memlimit) {
+      reclaim();
+      if(bytes + tileBytes > memlimit) {
+        full = true;
+        if(++attempts >= ntiles) { // Age all counts
+          attempts = 0;
+          for(size_t u = 0; u < ntiles; u++)
+            freq[u].store(freq[u].load(std::memory_order_relaxed) / 2, std::memory_order_relaxed);
+        }
+        if(resident.empty() || retired.size() >= maxRetired || !evict(freq[t])) {
+          freq[t].store(0, std::memory_order_relaxed); // Has to earn its demand again
+          return nullptr;
+        }
+        reclaim();
+      }
+    }
+
+    tile = new DTM[tileEntries];
+    std::fill(tile, tile + tileEntries, empty);
+    dir[t].store(tile, std::memory_order_release);
+    resident.push_back(t);
+    bytes += tileBytes;
+    return tile;
+  }
+
+  // Looks at the next few tiles of the clock and evicts the least used one if
+  // it was used less than the demand of the missing tile
+  bool evict(std::atomic<unsigned char> &demand) {
+    size_t best = hand;
+    int bestFreq = 256;
+    for(int k = 0; k < victimCandidates && k < (int)resident.size(); k++) {
+      if(hand >= resident.size())
+        hand = 0;
+      size_t t = resident[hand];
+      int f = freq[t].load(std::memory_order_relaxed);
+      if(f < bestFreq) {
+        bestFreq = f;
+        best = hand;
+      }
+      hand++;
+    }
+
+    if(bestFreq >= demand.load(std::memory_order_relaxed))
+      return false;
+
+    size_t t = resident[best];
+    resident[best] = resident.back();
+    resident.pop_back();
+    DTM *tile = dir[t].exchange(nullptr, std::memory_order_acq_rel);
+    freq[t].store(0, std::memory_order_relaxed);
+    retired.push_back(std::make_pair(tile, epoch.fetch_add(1) + 1));
+    return true;
+  }
+
+  // Frees retired tiles that no reader can hold anymore
+  void reclaim() {
+    if(retired.empty())
+      return;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    uint64_t minEpoch = offline;
+    for(int k = 0; k < std::min((int)threadCount, maxThreads); k++)
+      minEpoch = std::min(minEpoch, slots[k].epoch.load(std::memory_order_acquire));
+
+    for(size_t k = 0; k < retired.size(); ) {
+      if(retired[k].second <= minEpoch) {
+        delete[] retired[k].first;
+        bytes -= tileBytes;
+        retired[k] = retired.back();
+        retired.pop_back();
+      }
+      else
+        k++;
+    }
+  }
+};
@@ -0,0 +1,72 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+// Don't-look bits of a solution, by position. All positions are marked at
+// first, so that one sweep proves that no jump improves the solution. After
+// that, a position is examined again only if something around it moved.
+// This is a heuristic: a move can also change the best jump of a vertex far
+// away, but such jumps are rare and are left to the other operators.
+class DontLook {
+  std::vector<uint64_t> bits;
+  int n = 0;
+  int cursor = 0;
+  int marked = 0;
+
+public:
+  DontLook() {}
+
+  DontLook(int _n) {
+    reset(_n);
+  }
+
+  void reset(int _n) {
+    n = _n;
+    bits.assign((n + 63) / 64, 0);
+    cursor = 0;
+    marked = 0;
+    markAll();
+  }
+
+  int size() const {
+    return n;
+  }
+
+  // The positions of [lo,hi) changed, so all positions around them may have
+  // an improving jump
+  void changed(int lo, int hi) {
+    lo = std::max(0, lo - 1);
+    hi = std::min(n, hi + 1);
+    for(int p = lo; p < hi; p++) {
+      uint64_t &word = bits[p / 64], bit = (uint64_t)1 << (p % 64);
+      marked += !(word & bit);
+      word |= bit;
+    }
+  }
+
+  // Next position to examine, or -1 if converged
+  int next() {
+    if(marked == 0)
+      return -1;
+    int w = cursor / 64;
+    uint64_t word = bits[w] & (~(uint64_t)0 << (cursor % 64));
+    while(word == 0) {
+      w = w + 1 == (int)bits.size() ? 0 : w + 1;
+      word = bits[w];
+    }
+    int p = w * 64 + __builtin_ctzll(word);
+    bits[w] &= ~((uint64_t)1 << (p % 64));
+    marked--;
+    cursor = p + 1 == n ? 0 : p + 1;
+    return p;
+  }
+
+protected:
+  void markAll() {
+    std::fill(bits.begin(), bits.end(), ~(uint64_t)0);
+    if(n % 64)
+      bits.back() = ((uint64_t)1 << (n % 64)) - 1;
+    marked = n;
+  }
+};
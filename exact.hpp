@@ -0,0 +1,162 @@
+#pragma once
+#include "solvers.hpp"
+#include <unordered_map>
+#include <functional>
+
+// Branch and bound for the optimal order of a set of bottom vertices, built
+// from left to right. Each pair costs at least the smaller of its two costs,
+// so only the excess over that minimum is counted, and the excess of the
+// remaining pairs is bounded by 0. Placing v next costs the excess of v before
+// every vertex not placed yet, which is maintained incrementally. A vertex is
+// only placed once all vertices forced before it are, and never right after a
+// vertex that it should be swapped with. Prefixes are memoized by the set of
+// their vertices (Zobrist hashing), as the best completion of a prefix does
+// not depend on its order.
+template<class S>
+class BranchAndBound {
+  static constexpr size_t maxMemo = 1 << 20; // Entries of the memo (about 40 MB)
+  static constexpr size_t pollNodes = 1 << 14; // Nodes between calls to poll
+
+  S &solvers;
+  int n;
+  Order vertices;
+  std::vector<i64> excess; // excess[a*n+b]: if a comes before b, by index in vertices
+  std::vector<i64> step; // Excess of each vertex not placed yet if placed next
+  std::vector<int> pending; // Number of vertices forced before each one not placed yet
+  std::vector<char> placed;
+  std::vector<uint64_t> zobrist;
+  std::unordered_map<uint64_t,i64> memo;
+  std::vector<std::vector<int>> candidates; // Of each depth
+  std::vector<int> prefix, best;
+  std::vector<int> index; // Of each bottom vertex in vertices
+  i64 upper = 0; // Excess of best
+  std::function<bool(Order &)> poll;
+  bool aborted = false;
+  size_t nodes = 0;
+
+public:
+  BranchAndBound(S &_solvers, const Order &_vertices) : solvers(_solvers), n(_vertices.size()), vertices(_vertices),
+    excess((size_t)n * n, 0), step(n, 0), pending(n, 0), placed(n, 0), zobrist(n), candidates(n) {
+    auto guard = solvers.guard();
+    for(int a = 0; a < n; a++) {
+      for(int b = a + 1; b < n; b++) {
+        i64 d = solvers.costDiff(vertices[a], vertices[b], guard);
+        excess[(size_t)a*n+b] = std::max<i64>(0, -d);
+        excess[(size_t)b*n+a] = std::max<i64>(0, d);
+      }
+    }
+    std::mt19937_64 zgen(n);
+    for(int a = 0; a < n; a++) {
+      zobrist[a] = zgen();
+      for(int b = 0; b < n; b++) {
+        step[a] += excess[(size_t)a*n+b];
+        pending[a] += instance.forcedBefore(vertices[b], vertices[a]);
+      }
+    }
+  }
+
+  size_t nodeCount() const {
+    return nodes;
+  }
+
+  // Searches for an order better than the given one. From time to time,
+  // poll is called with an empty order that it may replace by a better
+  // solution found elsewhere, which then becomes the upper bound, and the
+  // search stops if it returns false. Returns true if the search finished, in
+  // which case the order is replaced by an optimal one.
+  bool solve(Order &order, std::function<bool(Order &)> _poll) {
+    poll = _poll;
+    index.resize(instance.n1);
+    for(int a = 0; a < n; a++)
+      index[vertices[a]] = a;
+    upper = excessOf(order);
+    best.clear();
+    for(int v : order)
+      best.push_back(index[v]);
+
+    search(0, 0, 0, -1);
+    if(aborted)
+      return false;
+    for(int i = 0; i < n; i++)
+      order[i] = vertices[best[i]];
+    return true;
+  }
+
+protected:
+  i64 excessOf(const Order &order) const {
+    i64 ret = 0;
+    for(int i = 0; i < n; i++)
+      for(int j = i + 1; j < n; j++)
+        ret += excess[(size_t)index[order[i]]*n+index[order[j]]];
+    return ret;
+  }
+
+  void place(int v, int sign) {
+    placed[v] = sign > 0;
+    const i64 *col = excess.data() + v;
+    for(int u = 0; u < n; u++) {
+      if(!placed[u]) {
+        step[u] -= sign * col[(size_t)u*n];
+        if(instance.forcedBefore(vertices[v], vertices[u]))
+          pending[u] -= sign;
+      }
+    }
+  }
+
+  void search(int depth, i64 cost, uint64_t hash, int last) {
+    if(depth == n) {
+      if(cost < upper) {
+        upper = cost;
+        best = prefix;
+      }
+      return;
+    }
+    if(++nodes % pollNodes == 0) {
+      Order better;
+      aborted = !poll(better);
+      i64 ex = better.empty() ? upper : excessOf(better);
+      if(ex < upper) {
+        upper = ex;
+        best.clear();
+        for(int v : better)
+          best.push_back(index[v]);
+      }
+    }
+    if(aborted)
+      return;
+
+    auto it = memo.find(hash);
+    if(it != memo.end()) {
+      if(it->second <= cost)
+        return;
+      it->second = cost;
+    }
+    else if(memo.size() < maxMemo)
+      memo.emplace(hash, cost);
+
+    std::vector<int> &cand = candidates[depth];
+    cand.clear();
+    for(int v = 0; v < n; v++) {
+      if(placed[v] || pending[v] > 0 || cost + step[v] >= upper)
+        continue;
+      // Swapping last and v would be better
+      if(last >= 0 && excess[(size_t)last*n+v] > 0)
+        continue;
+      cand.push_back(v);
+    }
+    std::sort(cand.begin(), cand.end(), [this](int a, int b) { return step[a] < step[b]; });
+
+    for(int v : cand) {
+      i64 c = cost + step[v];
+      if(c >= upper) // The upper bound may have decreased
+        break;
+      prefix.push_back(v);
+      place(v, 1);
+      search(depth + 1, c, hash ^ zobrist[v], v);
+      place(v, -1);
+      prefix.pop_back();
+      if(aborted)
+        return;
+    }
+  }
+};
@@ -0,0 +1,26 @@
+#pragma once
+#include <vector>
+
+// Binary indexed tree over positions [0,n) supporting point updates and
+// prefix sums, both in O(log n)
+template <class Number>
+struct Fenwick {
+  int n;
+  std::vector<Number> data;
+
+  Fenwick(int _n = 0) : n(_n), data(_n + 1, 0) {}
+
+  // Adds val at pos (0-based)
+  void add(int pos, Number val) {
+    for(pos++; pos <= n; pos += pos & -pos)
+      data[pos] += val;
+  }
+
+  // Returns the sum in range [0, end)
+  Number prefix(int end) const {
+    Number res = 0;
+    for(; end > 0; end -= end & -end)
+      res += data[end];
+    return res;
+  }
+};
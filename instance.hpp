@@ -2,16 +2,33 @@
 #include <string>
 #include <iostream>
 #include <cassert>
+#include <cstdlib>
 #include <vector>
 #include <fstream>
 #include <chrono>
 #include <random>
 #include <algorithm>
+#include <span>
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 using i64 = long long int;
 
 auto beginTime = std::chrono::high_resolution_clock::now();
-std::mt19937 rgen(1);
+thread_local std::mt19937 rgen(1); // Each worker thread reseeds its own copy
+
+// Next number of the splitmix64 stream of state x. Parallel tasks draw from
+// their own stream, seeded by their parent, so that their results do not
+// depend on the scheduling.
+inline uint64_t splitmix(uint64_t &x) {
+  uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
 
 inline double elapsed() {
   auto end = std::chrono::high_resolution_clock::now();
@@ -20,76 +37,269 @@ inline double elapsed() {
   return dur.count() / 1000.0;
 }
 
-inline std::vector<std::string> splitString(const std::string &s, char sep = ' ') {
-  std::vector<std::string> v;
-  std::string cur = "";
-
-  for(char c : s) {
-    if(c == sep) {
-      if(cur.size() != 0)
-        v.push_back(cur);
-      cur = "";
-    }
-    else
-      cur += c;
+// Reads a whole file descriptor in large chunks
+inline std::vector<char> readAll(int fd) {
+  std::vector<char> buf;
+  size_t size = 0;
+  while(true) {
+    buf.resize(size + (1 << 24));
+    ssize_t r = read(fd, buf.data() + size, buf.size() - size);
+    if(r <= 0)
+      break;
+    size += r;
   }
+  buf.resize(size);
+  return buf;
+}
 
-  if(cur.size() != 0)
-    v.push_back(cur);
-
-  return v;
+// Parses the next unsigned integer on the current line, skipping anything
+// else. Returns false at the end of the line, leaving p on the newline.
+inline bool nextInt(const char *&p, const char *end, int &x) {
+  while(p < end && *p != '\n' && (*p < '0' || *p > '9'))
+    p++;
+  if(p == end || *p == '\n')
+    return false;
+  x = 0;
+  while(p < end && *p >= '0' && *p <= '9')
+    x = 10 * x + (*p++ - '0');
+  return true;
 }
 
 struct Instance {
+  // Neighborhood summary of a bottom vertex. Isolated vertices get an empty
+  // interval [n0,-1] and a median and average of 0. The weight is the number
+  // of twins the vertex stands for (see reduceTwins).
+  struct Bottom {
+    int degree = 0, front = 0, back = -1;
+    int median = 0;
+    double average = 0;
+    int weight = 1;
+  };
+
   int n0 = 0, n1 = 0, m = 0;
-  std::vector<std::vector<int>> adj;
+  std::vector<int> offsets, targets; // Sorted neighbors of v in targets[offsets[v]..offsets[v+1]) (CSR)
+  std::vector<uint16_t> narrowTargets; // Copy of the lists of the bottom vertices if n0 fits in 16 bits
+  bool narrow = false;
   std::vector<int> v1;
+  std::vector<Bottom> bottom;
   int v1Degree = 0;
+  int v1WeightedDegree = 0; // Maximum of degree * weight
+  std::vector<std::vector<int>> twins; // Vertices merged into each vertex of v1
+  i64 twinCrossings = 0; // Crossings among merged twins, the same in every order
+  bool repeated = false; // Lists may repeat a neighbor (see coarsened)
 
   Instance() {}
 
+  // Reads fn, or the standard input if it cannot be opened. Regular files are
+  // mapped in memory, anything else is read in large chunks.
   Instance(std::string fn) {
-    std::ifstream f(fn);
-
-    std::string line;
-    int curm = 0;
-    while (!f ? std::getline(std::cin, line) : std::getline(f, line)) {
-      if(line.empty() || line[0] == 'c')
-        continue; // Comment line
-      if(line[0] == 'p') {
-        auto v = splitString(line);
-        assert(v.size() >= 5); // 5 for exact and heuristic, 6 for parameterized
-        n0 = std::stoi(v[2]);
-        n1 = std::stoi(v[3]);
-        m = std::stoi(v[4]);
-        adj.resize(n0+n1);
+    int fd = open(fn.c_str(), O_RDONLY);
+    struct stat st;
+    void *mapped = MAP_FAILED;
+    size_t size = 0;
+    if(fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+      size = st.st_size;
+      mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+
+    std::vector<char> buf;
+    const char *p, *end;
+    if(mapped != MAP_FAILED) {
+      madvise(mapped, size, MADV_SEQUENTIAL);
+      p = (const char *) mapped;
+    }
+    else {
+      buf = readAll(fd >= 0 ? fd : 0);
+      p = buf.data();
+      size = buf.size();
+    }
+    end = p + size;
+
+    std::vector<int> edges; // Endpoints of the edges, two by two
+    while(p < end) {
+      if(*p == 'p') {
+        // 5 fields for exact and heuristic, 6 for parameterized
+        if(!nextInt(p, end, n0) || !nextInt(p, end, n1) || !nextInt(p, end, m) || n0 < 0 || n1 < 0 || m < 0) {
+          std::cerr << "Invalid p line in " << (fd >= 0 ? fn : "the standard input") << std::endl;
+          exit(1);
+        }
+        edges.reserve(2 * (size_t) m);
       }
-      else {
-        auto v = splitString(line);
-        if(v.size() == 2) {
-          int a,b;
-          a = std::stoi(v[0]) - 1;
-          b = std::stoi(v[1]) - 1;
-          adj.at(a).push_back(b);
-          adj.at(b).push_back(a);
-          curm++;
+      else if(*p != 'c') { // Not a comment line
+        int a, b;
+        if(nextInt(p, end, a) && nextInt(p, end, b)) {
+          if(a < 1 || a > n0+n1 || b < 1 || b > n0+n1) {
+            std::cerr << "Invalid edge " << a << " " << b << " in " << (fd >= 0 ? fn : "the standard input") << std::endl;
+            exit(1);
+          }
+          edges.push_back(a - 1);
+          edges.push_back(b - 1);
         }
       }
+      while(p < end && *p++ != '\n');
     }
 
-    for(int i = 0; i < n0+n1; i++) {
-      std::sort(adj[i].begin(), adj[i].end());
+    if(mapped != MAP_FAILED)
+      munmap(mapped, size);
+    if(fd >= 0)
+      close(fd);
+
+    // Lists in input order first, then transposed: going through the
+    // vertices in increasing order leaves every list sorted
+    int n = n0 + n1;
+    offsets.assign(n + 1, 0);
+    for(int v : edges)
+      offsets[v + 1]++;
+    for(int v = 0; v < n; v++)
+      offsets[v + 1] += offsets[v];
+
+    std::vector<int> unsorted(edges.size()), cursor(offsets.begin(), offsets.end() - 1);
+    for(size_t e = 0; e < edges.size(); e += 2) {
+      unsorted[cursor[edges[e]]++] = edges[e + 1];
+      unsorted[cursor[edges[e + 1]]++] = edges[e];
     }
+    std::vector<int>().swap(edges);
+
+    targets.resize(unsorted.size());
+    std::copy(offsets.begin(), offsets.end() - 1, cursor.begin());
+    for(int u = 0; u < n; u++)
+      for(int k = offsets[u]; k < offsets[u + 1]; k++)
+        targets[cursor[unsorted[k]]++] = u;
 
+    bottom.resize(n1);
     for(int i = n0; i < n0+n1; i++) {
-      if(adj[i].size())
+      auto a = adj(i);
+      if(a.size()) {
         v1.push_back(i-n0);
-      v1Degree = std::max(v1Degree, (int)adj[i].size());
+        double sum = 0.0;
+        for(int x : a)
+          sum += x;
+        bottom[i-n0] = {(int)a.size(), a.front(), a.back(), a[a.size() / 2], sum / a.size()};
+      }
+      else
+        bottom[i-n0] = {0, n0, -1, 0, 0};
+      v1Degree = std::max(v1Degree, (int)a.size());
     }
+    v1WeightedDegree = v1Degree;
+    twins.resize(n1);
+
+    narrow = n0 <= 65536;
+    if(narrow)
+      narrowTargets.assign(targets.begin() + offsets[n0], targets.end());
   }
 
   ~Instance() {
   }
+
+  // Instance whose bottom vertices are the given groups of vertices of v1.
+  // The list of a group has the neighbors of all its vertices, repeated for
+  // each twin, so that the crossings between two groups are those between
+  // their vertices. Crossings inside a group are not counted. Only the lists
+  // of the bottom vertices are kept, and never narrow.
+  Instance coarsened(const std::vector<std::vector<int>> &groups) const {
+    Instance c;
+    c.n0 = n0;
+    c.n1 = groups.size();
+    c.repeated = true;
+    c.offsets.assign(n0 + 1, 0);
+    for(auto &g : groups) {
+      for(int i : g) {
+        auto a = adj(n0+i);
+        for(int k = 0; k < bottom[i].weight; k++)
+          c.targets.insert(c.targets.end(), a.begin(), a.end());
+      }
+      std::sort(c.targets.begin() + c.offsets.back(), c.targets.end());
+      c.offsets.push_back(c.targets.size());
+    }
+    c.m = c.targets.size();
+
+    c.bottom.resize(c.n1);
+    c.twins.resize(c.n1);
+    for(int i = 0; i < c.n1; i++) {
+      auto a = c.adj(n0+i);
+      c.v1.push_back(i);
+      double sum = 0.0;
+      for(int x : a)
+        sum += x;
+      c.bottom[i] = {(int)a.size(), a.front(), a.back(), a[a.size() / 2], sum / a.size()};
+      c.v1Degree = std::max(c.v1Degree, (int)a.size());
+    }
+    c.v1WeightedDegree = c.v1Degree;
+    return c;
+  }
+
+  std::span<const int> adj(int v) const {
+    return {targets.data() + offsets[v], targets.data() + offsets[v+1]};
+  }
+
+  // Replaces the bottom vertices with the same neighbors (twins) by one vertex
+  // of v1 whose weight is their number. Some optimal order has the twins
+  // consecutive, since their relative order changes no crossing. Returns the
+  // number of vertices removed from v1.
+  int reduceTwins() {
+    std::vector<std::pair<uint64_t,int>> hashes;
+    for(int i : v1) {
+      uint64_t h = 1469598103934665603ULL;
+      for(int x : adj(n0+i))
+        h = (h ^ x) * 1099511628211ULL;
+      hashes.push_back(std::make_pair(h, i));
+    }
+    std::sort(hashes.begin(), hashes.end());
+
+    std::vector<int> reduced;
+    std::vector<char> merged(n1, 0);
+    for(size_t r0 = 0, r1; r0 < hashes.size(); r0 = r1) {
+      for(r1 = r0; r1 < hashes.size() && hashes[r1].first == hashes[r0].first; r1++);
+      for(size_t k = r0; k < r1; k++) {
+        int i = hashes[k].second;
+        if(merged[i])
+          continue;
+        reduced.push_back(i);
+        auto ai = adj(n0+i);
+        for(size_t l = k + 1; l < r1; l++) {
+          int j = hashes[l].second;
+          auto aj = adj(n0+j);
+          if(!merged[j] && std::equal(ai.begin(), ai.end(), aj.begin(), aj.end())) {
+            merged[j] = 1;
+            twins[i].push_back(j);
+          }
+        }
+      }
+    }
+    std::sort(reduced.begin(), reduced.end());
+    int removed = v1.size() - reduced.size();
+    v1 = reduced;
+
+    for(int i : v1) {
+      Bottom &b = bottom[i];
+      b.weight = 1 + twins[i].size();
+      twinCrossings += twinCrossingsOf(i);
+      v1WeightedDegree = std::max(v1WeightedDegree, b.degree * b.weight);
+    }
+    return removed;
+  }
+
+  // True if all neighbors of the bottom vertex i come before or at all
+  // neighbors of j, except if both have the same single neighbor. Then i
+  // before j has no crossing and j before i has some, so i comes before j in
+  // every optimal order. This partial order is an interval order, and thus
+  // already transitively closed.
+  bool forcedBefore(int i, int j) const {
+    const Bottom &bi = bottom[i], &bj = bottom[j];
+    return bi.back <= bj.front && bi.front < bj.back;
+  }
+
+  // Crossings among the twins merged into i
+  i64 twinCrossingsOf(int i) const {
+    const Bottom &b = bottom[i];
+    return (i64)b.weight * (b.weight - 1) / 2 * ((i64)b.degree * (b.degree - 1) / 2);
+  }
+
+  // Neighbors of the bottom vertex i, only if narrow
+  std::span<const uint16_t> narrowAdj(int i) const {
+    const uint16_t *base = narrowTargets.data() - offsets[n0];
+    return {base + offsets[n0+i], base + offsets[n0+i+1]};
+  }
 };
 
 
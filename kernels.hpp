@@ -0,0 +1,220 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <immintrin.h>
+
+// Counting kernels for the cost of a pair of bottom vertices. Given the
+// sorted neighbor lists a and b (without repeated entries, as int or as
+// uint16_t when the top vertices fit), they compute
+//   c1 = #{(x,y) in a*b : y > x}, the crossings when b comes before a
+//   c2 = #{(x,y) in a*b : y < x}, the crossings when a comes before b
+// costPair picks the fastest kernel for the sizes and the processor.
+
+struct CostPair {
+  long long c1 = 0, c2 = 0;
+};
+
+// Merge counting. When b[ib] < a[ia], b[ib] is smaller than all remaining
+// elements of a, and symmetrically.
+template<class T>
+inline CostPair costPairScalar(const T *a, int na, const T *b, int nb) {
+  long long c1 = 0, c2 = 0;
+  int ia = 0, ib = 0;
+  while(ia < na && ib < nb) {
+    if(b[ib] < a[ia]) {
+      c2 += na - ia;
+      ib++;
+    }
+    else if(b[ib] > a[ia]) {
+      c1 += nb - ib;
+      ia++;
+    }
+    else {
+      c2 += na - ia - 1;
+      c1 += nb - ib - 1;
+      ia++;
+      ib++;
+    }
+  }
+  return {c1, c2};
+}
+
+// Same as costPairScalar for lists that may repeat values, by runs of equal
+// values (only used for coarsened instances, the other kernels assume sets)
+template<class T>
+inline CostPair costPairRepeated(const T *a, int na, const T *b, int nb) {
+  long long c1 = 0, c2 = 0;
+  int ia = 0, ib = 0;
+  while(ia < na && ib < nb) {
+    if(b[ib] < a[ia]) {
+      c2 += na - ia;
+      ib++;
+    }
+    else if(b[ib] > a[ia]) {
+      c1 += nb - ib;
+      ia++;
+    }
+    else {
+      T x = a[ia];
+      int ra = 1, rb = 1;
+      while(ia + ra < na && a[ia + ra] == x)
+        ra++;
+      while(ib + rb < nb && b[ib + rb] == x)
+        rb++;
+      c2 += (long long)rb * (na - ia - ra);
+      c1 += (long long)ra * (nb - ib - rb);
+      ia += ra;
+      ib += rb;
+    }
+  }
+  return {c1, c2};
+}
+
+// For na much smaller than nb: finds each element of a in b with an
+// exponential search starting from the previous position
+template<class T>
+inline CostPair costPairGallop(const T *a, int na, const T *b, int nb) {
+  long long c1 = 0, c2 = 0;
+  int lo = 0;
+  for(int ia = 0; ia < na; ia++) {
+    T x = a[ia];
+    int step = 1, hi = lo;
+    while(hi < nb && b[hi] < x) {
+      lo = hi + 1;
+      hi += step;
+      step *= 2;
+    }
+    lo = std::lower_bound(b + lo, b + std::min(hi, nb), x) - b; // Number of elements < x
+    int le = lo + (lo < nb && b[lo] == x);
+    c2 += lo;
+    c1 += nb - le;
+  }
+  return {c1, c2};
+}
+
+// Block counting: compares blocks of 8 elements of a and b all against all
+// using 8 rotations of the b block. The block with the smaller maximum is
+// then retired, since it is smaller than everything left in the other list.
+// Wider blocks do not pay off: the comparisons per retired element grow with
+// the block size.
+__attribute__((target("avx2")))
+inline __m256i load8(const int *p) {
+  return _mm256_loadu_si256((const __m256i *)p);
+}
+
+__attribute__((target("avx2")))
+inline __m256i load8(const uint16_t *p) {
+  return _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)p));
+}
+
+template<class T>
+__attribute__((target("avx2")))
+inline CostPair costPairAvx2(const T *a, int na, const T *b, int nb) {
+  long long c1 = 0, c2 = 0;
+  int ia = 0, ib = 0;
+  const __m256i rot = _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 0);
+  __m256i acc1 = _mm256_setzero_si256(), acc2 = _mm256_setzero_si256();
+
+  while(ia + 8 <= na && ib + 8 <= nb) {
+    __m256i va = load8(a + ia);
+    __m256i vb = load8(b + ib);
+    for(int r = 0; r < 8; r++) {
+      acc2 = _mm256_sub_epi32(acc2, _mm256_cmpgt_epi32(va, vb));
+      acc1 = _mm256_sub_epi32(acc1, _mm256_cmpgt_epi32(vb, va));
+      vb = _mm256_permutevar8x32_epi32(vb, rot);
+    }
+    if(a[ia + 7] <= b[ib + 7]) {
+      c1 += 8LL * (nb - ib - 8);
+      ia += 8;
+    }
+    else {
+      c2 += 8LL * (na - ia - 8);
+      ib += 8;
+    }
+  }
+
+  alignas(32) int lanes1[8], lanes2[8];
+  _mm256_store_si256((__m256i *)lanes1, acc1);
+  _mm256_store_si256((__m256i *)lanes2, acc2);
+  for(int k = 0; k < 8; k++) {
+    c1 += lanes1[k];
+    c2 += lanes2[k];
+  }
+
+  CostPair tail = costPairScalar(a + ia, na - ia, b + ib, nb - ib);
+  return {c1 + tail.c1, c2 + tail.c2};
+}
+
+template<class T>
+using CostPairKernel = CostPair (*)(const T *, int, const T *, int);
+
+// The block kernel for this processor, chosen once
+template<class T>
+inline CostPairKernel<T> costPairBlock = []() -> CostPairKernel<T> {
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2"))
+    return costPairAvx2<T>;
+  return costPairScalar<T>;
+}();
+
+template<class T>
+inline CostPair costPair(const T *a, int na, const T *b, int nb) {
+  if(na * 32 < nb)
+    return costPairGallop(a, na, b, nb);
+  if(nb * 32 < na) {
+    CostPair p = costPairGallop(b, nb, a, na);
+    return {p.c2, p.c1};
+  }
+  if(na < 8 || nb < 8)
+    return costPairScalar(a, na, b, nb);
+  return costPairBlock<T>(a, na, b, nb);
+}
+
+// Replaces a[0..n) by its prefix sums and returns their maximum (the minimum
+// i64 if n is 0). Used to find the best insertion position of a vertex from
+// the cost differences with the vertices it would pass.
+inline long long prefixSumMaxScalar(long long *a, int n) {
+  long long sum = 0, best = std::numeric_limits<long long>::min();
+  for(int k = 0; k < n; k++) {
+    sum += a[k];
+    a[k] = sum;
+    best = std::max(best, sum);
+  }
+  return best;
+}
+
+// Scan of 4 lanes in two shift-and-add steps, plus the carry of the previous
+// lanes
+__attribute__((target("avx2")))
+inline long long prefixSumMaxAvx2(long long *a, int n) {
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i carry = zero;
+  __m256i vbest = _mm256_set1_epi64x(std::numeric_limits<long long>::min());
+  int k = 0;
+  for(; k + 4 <= n; k += 4) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(a + k));
+    x = _mm256_add_epi64(x, _mm256_blend_epi32(_mm256_permute4x64_epi64(x, 0x90), zero, 0x03)); // [0,a,b,c]
+    x = _mm256_add_epi64(x, _mm256_permute2x128_si256(x, x, 0x08)); // [0,0,a,b]
+    x = _mm256_add_epi64(x, carry);
+    _mm256_storeu_si256((__m256i *)(a + k), x);
+    vbest = _mm256_blendv_epi8(vbest, x, _mm256_cmpgt_epi64(x, vbest));
+    carry = _mm256_permute4x64_epi64(x, 0xff);
+  }
+
+  alignas(32) long long lanes[4];
+  _mm256_store_si256((__m256i *)lanes, vbest);
+  long long best = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+  long long sum = k > 0 ? a[k - 1] : 0;
+  for(; k < n; k++) {
+    sum += a[k];
+    a[k] = sum;
+    best = std::max(best, sum);
+  }
+  return best;
+}
+
+inline long long (*const prefixSumMax)(long long *, int) = []() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") ? prefixSumMaxAvx2 : prefixSumMaxScalar;
+}();
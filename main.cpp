@@ -2,10 +2,19 @@
 #include "solution.hpp"
 #include "solpool.hpp"
 #include "solvers.hpp"
+#include "exact.hpp"
+#include "bounds.hpp"
+#include "multilevel.hpp"
+#include "opstats.hpp"
+#include "trace.hpp"
+#include "workqueue.hpp"
+#include "blocks.hpp"
 #include <signal.h>
+#include <pthread.h>
 #include <cstring>
 #include <sstream>
 #include <variant>
+#include <thread>
 
 // Memory limit for the matrix
 size_t memlimit = (size_t) 8e9;
@@ -13,37 +22,165 @@ size_t memlimit = (size_t) 8e9;
 #ifdef EXACT
 double maxTime = 30 * 60 - 10; // Time in seconds before terminating (exact version)
 int nSols = 32; // Number of solutions kept
+double precomputeTime = maxTime / 2; // See below
+double exactTime = maxTime; // See below
+double exactEnd = maxTime / 2; // See below
 #else
 double maxTime = 5 * 60 - 5; // Time in seconds before terminating (heuristic version)
 int nSols = 12; // Number of solutions kept
+double precomputeTime = 30; // See below
+double exactTime = 10; // See below
+double exactEnd = maxTime; // See below
 #endif
 
+// Number of threads improving the solutions (at most one per solution), two
+// of which first run the background searches below. The workers, tasks,
+// precompute and background threads together must stay below maxThreads (see
+// costcache.hpp).
+int nThreads = std::min(std::max(1u, std::thread::hardware_concurrency()), (unsigned) maxThreads / 4);
+
+// The lower bound and the matrix are computed together by all threads before
+// building the initial solutions, for at most precomputeTime seconds (the
+// bound is partial if the time runs out). If precomputeBackground is set,
+// this runs in background threads while the initial solutions are built
+// instead. If precomputeBand > 0, only pairs of vertices at most that far
+// apart in the matrix are stored.
+bool precomputeBackground = false;
+int precomputeBand = 0;
+
+// Independent blocks of bottom vertices are solved separately, each with its
+// own solutions. Blocks with fewer vertices are grouped with the next ones.
+int minBlockSize = 64;
+
+// Blocks of at most exactMaxSize vertices are solved by branch and bound in a
+// background thread, smallest first, for at most exactTime seconds in total
+// and not after exactEnd seconds from the start (however long the precompute
+// took), while the workers improve the solutions. The blocks whose search
+// finishes are optimal. The memory used is quadratic in the block size.
+int exactMaxSize = 2000;
+
+// In the heuristic version, the search of a block is given up after
+// exactNodes nodes, so that the branch and bound only spends time on the
+// blocks that it can finish quickly.
+#ifdef EXACT
+size_t exactNodes = std::numeric_limits<size_t>::max();
+#else
+size_t exactNodes = 1 << 16;
+#endif
+
+// The lower bound of each block is raised by 3-cycles of pairs in another
+// background thread, for at most boundTime seconds in total. A block stops
+// as soon as its best solution meets its bound.
+double boundTime = maxTime / 10;
+
+// The last annealSols solutions of each block are improved by simulated
+// annealing (see Solvers::anneal) instead of the descents, annealTime seconds
+// at a time, until the other solutions of the block agree. The temperature,
+// in average cost differences of adjacent vertices, decreases linearly from
+// annealTemperature to 0 at maxTime. Off by default: on our instances it finds
+// the same solutions, while the descents agree later.
+int annealSols = 0;
+double annealTime = 0.5;
+double annealTemperature = 0.2;
+
+// If adaptiveScheduling is set, each solution taken by a worker gets
+// scheduleQuantum seconds of one operator chosen by a bandit (see Scheduler)
+// from their improvement per second so far, instead of the fixed sequence of
+// quick and slow phases.
+bool adaptiveScheduling = false;
+double scheduleQuantum = 0.05;
+
+// A solution whose order is the same as another one is replaced once, by the
+// best order on the path between two different orders with the fewest
+// crossings of its block, over the fraction relinkDepth of the way (see
+// Solvers::relink), improved by jumps. While the block has a single such
+// order, the path starts from a new split solution instead.
+// Equal orders count once in the confidence, also after a replacement.
+double relinkDepth = 0.5;
+
+// Every other initial solution of the blocks with more than multilevelSize
+// vertices is built by coarsening them down to multilevelCoarse vertices,
+// solving that and refining back, in about multilevelTime seconds (see
+// multilevel.hpp). The others are sorted by average in the heuristic version,
+// and split in the exact one.
+// The caches of the coarse levels of each such block use at most
+// multilevelMemory bytes, taken out of memlimit (up to a quarter of it).
+int multilevelSize = 30000;
+int multilevelCoarse = 5000;
+double multilevelTime = 2;
+size_t multilevelMemory = (size_t)1 << 29;
+
+// Windows of consecutive vertices of this size (at most 20) are reordered
+// optimally by dynamic programming, whose time is exponential in the size
+int windowSize = 10;
+
+// If a third argument is given, a JSON line is written to it for every
+// improvement of the best solution, and every tracePeriod seconds with the
+// crossings, lower bound, confidence and matrix fill (see trace.hpp). It is
+// a file name, or unix:path to connect to a Unix socket.
+std::string traceDest;
+double tracePeriod = 1;
 
 std::string instfn, solfn;
-i64 lowerBound = 0;
+std::atomic<i64> lowerBound = 0; // Written by the precompute, maybe in the background
+Blocks blocks;
+std::vector<std::unique_ptr<SolPool>> pools; // One per block
+std::atomic<bool> poolsReady = false; // Set once all pools are built
+Scheduler scheduler; // Shared by all workers, if adaptiveScheduling
+std::atomic<int> activeBlocks = 0;
+std::atomic<bool> exactFinished = false; // The branch and bound returned
 
-void nop(int signum) {
-  return;
+// A block is done when its best solution is optimal or nSols different
+// orders have the best crossings or all its solutions agreed after their
+// replacements (see SolPool::agreed). In the exact version, the agreement
+// only ends the blocks that the branch and bound no longer searches: the ones
+// too large for it, and all of them once it returned, so that it is never
+// cancelled by the workers.
+bool blockDone(const SolPool &pool) {
+  bool agreed = pool.nBest() >= nSols || pool.agreed(nSols);
+#ifdef EXACT
+  return pool.optimal() || (agreed && (exactFinished || pool.size() > exactMaxSize));
+#else
+  return pool.optimal() || agreed;
+#endif
 }
 
-// This function is called to output a solution and finish the program
-// It may be called by a signal hander, in this case the behavior is
-// unpredictable as it calls non-reentrant functions.
-// Normally it seems to work though!
-void terminate(int signum = -1) {
-  if(signum == -1) { // Make sure a signal does not call this again
-    struct sigaction action;
-    memset(&action, 0, sizeof(struct sigaction));
-    action.sa_handler = nop;
-    sigaction(SIGTERM, &action, NULL);
-    sigaction(SIGINT, &action, NULL);
-  }
+// Smallest number of different orders as good as the best among blocks that
+// are not optimal, where blocks whose solutions agreed count as nSols
+int confidenceCount() {
+  if(!poolsReady)
+    return 0;
+  int nbest = nSols;
+  for(auto &pool : pools)
+    if(!pool->optimal() && !pool->agreed(nSols))
+      nbest = std::min(nbest, pool->nBest());
+  return nbest;
+}
+
+// The best solution of every block is optimal
+bool provenOptimal() {
+  if(!poolsReady)
+    return false;
+  if(global_crossings <= lowerBound)
+    return true;
+  return !pools.empty() && std::all_of(pools.begin(), pools.end(), [](auto &pool) { return pool->optimal(); });
+}
+
+// Outputs the best solution and ends the program. Called at the end of main,
+// when a solution meets the lower bound, and by the signal thread on SIGINT
+// or SIGTERM, none of which holds a lock. Only the first call does anything,
+// the others wait for it to exit. The trace ends after the solution is saved.
+void terminate() {
+  static std::atomic<bool> terminating = false;
+  if(terminating.exchange(true))
+    while(true)
+      std::this_thread::sleep_for(std::chrono::hours(1));
 
   std::string confidence;
   if(showProgress) {
-    if(global_crossings > lowerBound) {
+    if(!provenOptimal()) {
       std::stringstream confidencess;
-      confidencess << global_nbest << "/" << nSols;
+      confidencess << confidenceCount() << "/" << nSols;
       confidence = confidencess.str();
     }
     else {
@@ -52,61 +189,336 @@ void terminate(int signum = -1) {
   }
 
 #ifdef EXACT
-  if(global_crossings > lowerBound && global_nbest < .75 * nSols) {
+  if(!provenOptimal() && confidenceCount() < .75 * nSols) {
     if(showProgress) {
         std::cout << std::endl << "Found solution with " << global_crossings << " crossings but the confidence is too small: " << confidence <<  std::endl;
     }
+    trace.finish();
     _Exit(1);
   }
 #endif
-  if(global_best != nullptr) {
-    if(instfn.empty())
-      print(instance, *global_best);
-    else {
-      save(instance, *global_best, solfn);
-      if(solfn.empty())
-        std::cout << std::endl << "Found solution with " << global_crossings << " crossings and confidence "  << confidence << " but did not save it because no filename given"<< std::endl;
-      else
-        std::cout << std::endl << "Saved solution with " << global_crossings << " crossings and confidence "  << confidence << " to " << solfn << std::endl;
-    }
-    _Exit(0);
+  // Copy of the best solution, which the workers may still be improving
+  Order best;
+  i64 cr;
+  {
+    std::lock_guard lock(global_mutex);
+    if(global_best == nullptr)
+      _Exit(1);
+    best = *global_best;
+    cr = global_crossings;
   }
-  _Exit(1);
+
+  if(instfn.empty())
+    print(instance, best);
+  else {
+    save(instance, best, solfn);
+    if(solfn.empty())
+      std::cout << std::endl << "Found solution with " << cr << " crossings and confidence "  << confidence << " but did not save it because no filename given"<< std::endl;
+    else
+      std::cout << std::endl << "Saved solution with " << cr << " crossings and confidence "  << confidence << " to " << solfn << std::endl;
+  }
+  trace.finish();
+  _Exit(0);
 }
 
+// Builds the initial solutions of all blocks as parallel tasks, the first
+// rounds first. Each solution reseeds rgen from its round and block, so that
+// it does not depend on the scheduling.
 template<class T>
-void fillSolutions(SolPool &solPool, i64 lowerBound, T &solvers) {
-  for(int i = 0; i < nSols; i++) {
-    Order sol = instance.v1;
+void fillSolutions(T &solvers) {
+  std::vector<std::unique_ptr<Multilevel<T>>> multilevels(pools.size());
+  auto build = [&](int i, size_t b) {
+    SolPool &pool = *pools[b];
+    if(pool.optimal() || (i > 0 && elapsed() > maxTime / 5))
+      return;
+    auto saved = rgen;
+    uint64_t seed = (uint64_t)i << 32 | b;
+    rgen.seed(splitmix(seed));
+    Order sol = pool.vertices();
     std::shuffle(sol.begin(), sol.end(), rgen);
     if(i == 0)
       solvers.solveAvg(sol.begin(), sol.end());
     else if(i == 1)
       solvers.solveMedian(sol.begin(), sol.end());
+    else if((int)sol.size() > multilevelSize && i % 2 == 0)
+      sol = multilevels[b]->solve(multilevelTime);
 #ifndef EXACT
-    else if(instance.n1 > 30000)
+    else if((int)sol.size() > multilevelSize)
       solvers.solveAvgRand(sol.begin(), sol.end());
 #endif
     else
       solvers.solveSplit(sol.begin(), sol.end());
+    rgen = saved;
 
-    i64 cr = crossings(instance, sol.begin(), sol.end());
-    solPool.insert(sol);
-
-    if(elapsed() > maxTime || cr <= lowerBound)
+    pool.insert(sol);
+    if(elapsed() > maxTime)
       terminate();
+  };
+
+  // The first two rounds, and the levels of the multilevel solutions
+  {
+    TaskPool::Group group(*taskPool);
+    for(size_t b = 0; b < pools.size(); b++) {
+      if(nSols > 2 && (int)pools[b]->size() > multilevelSize) {
+        group.run([&, b]() {
+          multilevels[b] = std::make_unique<Multilevel<T>>(solvers, pools[b]->vertices(), multilevelCoarse, multilevelMemory);
+        });
+      }
+    }
+    for(int i = 0; i < std::min(nSols, 2); i++)
+      for(size_t b = 0; b < pools.size(); b++)
+        group.run([&build, i, b]() { build(i, b); });
+  }
+  if(global_crossings <= lowerBound)
+    terminate();
+
+  {
+    TaskPool::Group group(*taskPool);
+    for(int i = 2; i < nSols; i++)
+      for(size_t b = 0; b < pools.size(); b++)
+        group.run([&build, i, b]() { build(i, b); });
+  }
+  if(showProgress) {
+    size_t bytes = 0;
+    int depth = 0;
+    for(auto &m : multilevels) {
+      if(m) {
+        bytes += m->memory();
+        depth = std::max(depth, m->depth());
+      }
+    }
+    if(depth > 0)
+      std::cout << std::endl << "Multilevel: " << depth << " levels, " << bytes / 1e6 << " MB";
+  }
+  if(global_crossings <= lowerBound)
+    terminate();
+}
+
+// Set when the workers are done, to stop the background threads
+std::atomic<bool> stopBackground = false;
+
+// Runs the branch and bound on the blocks small enough, in the background,
+// with the best solution of each block (improved meanwhile by the workers) as
+// the upper bound
+
+template<class T>
+void solveExactly(T &solvers) {
+  improvingOperator = "branch and bound";
+  std::vector<int> order;
+  for(int b = 0; b < blocks.size(); b++)
+    if(!pools[b]->optimal() && pools[b]->size() <= exactMaxSize)
+      order.push_back(b);
+  std::stable_sort(order.begin(), order.end(), [](int a, int b) { return pools[a]->size() < pools[b]->size(); });
 
-    if(elapsed() > maxTime / 5)
+  double t = elapsed(), deadline = std::min({maxTime, exactEnd, t + exactTime});
+  int nOptimal = 0;
+  for(int b : order) {
+    SolPool &pool = *pools[b];
+    if(pool.optimal())
+      continue;
+    Order sol = pool.bestOrder();
+    i64 bound = pool.bestCrossings();
+    BranchAndBound<T> search(solvers, sol);
+    auto poll = [&](Order &better) {
+      if(pool.bestCrossings() < bound) {
+        bound = pool.bestCrossings();
+        better = pool.bestOrder();
+      }
+      return !stopBackground && !pool.optimal() && elapsed() < deadline && search.nodeCount() < exactNodes;
+    };
+    if(search.solve(sol, poll)) {
+      pool.setOptimal(sol, crossings(instance, sol.begin(), sol.end()));
+      nOptimal++;
+    }
+    if(stopBackground || elapsed() >= deadline)
       break;
   }
+  exactFinished = true;
+  if(showProgress && !order.empty())
+    std::cout << std::endl << "Branch and bound: " << nOptimal << " of " << order.size() << " blocks optimal in " << std::round(1000 * (elapsed() - t)) / 1000 << " seconds" << std::endl;
+}
+
+// Raises the lower bounds of the blocks that are not optimal, in the
+// background, starting with the smallest gaps
+template<class T>
+void improveBounds(T &solvers) {
+  std::vector<int> order;
+  for(int b = 0; b < blocks.size(); b++)
+    if(!pools[b]->optimal())
+      order.push_back(b);
+  std::stable_sort(order.begin(), order.end(), [](int a, int b) {
+    return pools[a]->bestCrossings() - pools[a]->getLowerBound() < pools[b]->bestCrossings() - pools[b]->getLowerBound();
+  });
+
+  double t = elapsed(), deadline = std::min(maxTime, t + boundTime);
+  i64 total = 0;
+  for(int b : order) {
+    SolPool &pool = *pools[b];
+    i64 base = pool.getLowerBound();
+    total += triangleBound(solvers, pool.vertices(), [&](i64 added) {
+      pool.setLowerBound(base + added);
+      return !stopBackground && !pool.optimal() && elapsed() < deadline;
+    });
+    if(stopBackground || elapsed() >= deadline)
+      break;
+  }
+  if(showProgress)
+    std::cout << std::endl << "Lower bound raised by " << total << " by 3-cycles in " << elapsed() - t << " seconds" << std::endl;
+}
+
+// Worker loop: repeatedly takes a solution of some block from the queue and
+// improves it. Work items are block * nSols + index. A solution that improved
+// goes back to the end of the worker's own lane, so that the same worker
+// keeps working on it, as better solutions deserve more time, unless its
+// block already had more than its share of the time. The solutions of
+// finished blocks are dropped.
+template<class T>
+void improveSolutions(WorkQueue &queue, int w, T &solvers, bool exact) {
+  rgen.seed(w + 2); // The main thread uses seed 1
+  int hardInstance = 0;
+
+  while(activeBlocks > 0 && elapsed() < maxTime) {
+    int item;
+    if(!queue.wait(w, item, 0.01)) // All solutions are taken by other workers
+      continue;
+
+    SolPool &solPool = *pools[item / nSols];
+    int i = item % nSols;
+    if(blockDone(solPool)) { // Possibly proven optimal by the branch and bound
+      if(solPool.finish())
+        activeBlocks--;
+      continue;
+    }
+    Order &sol = solPool[i];
+    DontLook &look = solPool.look(i);
+    i64 improvement = 0;
+    double t0 = elapsed();
+
+    if(solPool.duplicate(i)) {
+      auto [fresh, guide] = solPool.elitePair();
+      if(fresh.empty()) { // A single best order so far
+        fresh = solPool.vertices();
+        std::shuffle(fresh.begin(), fresh.end(), rgen);
+        solvers.solveSplit(fresh.begin(), fresh.end());
+        guide = solPool.bestOrder();
+      }
+      measured(solvers, Operator::Relink, [&]() {
+        return solvers.relink(fresh.begin(), fresh.end(), guide, relinkDepth, maxTime - elapsed());
+      });
+      DontLook freshLook(fresh.size());
+      solvers.optimizeJump(fresh.begin(), fresh.end(), freshLook, maxTime - elapsed());
+      solPool.replace(i, fresh);
+      solPool.spend(elapsed() - t0);
+      queue.pushBack(w, item);
+      continue;
+    }
+
+    // Once the other solutions agree, the annealing ones use the descents too,
+    // so that the block can be done
+    bool annealing = i >= nSols - annealSols && solPool.nBest() < nSols - annealSols;
+    auto slice = [&](bool jump, int radius = 0) {
+      return measured(solvers, jump ? Operator::JumpSlice : Operator::QuickSlice, [&]() {
+        return solvers.optimizeSlice(sol.begin(), sol.end(), jump, &look, radius);
+      });
+    };
+    auto jumps = [&](double t) {
+      return measured(solvers, Operator::Jump, [&]() { return solvers.timedOptimizeJump(sol.begin(), sol.end(), t, look); });
+    };
+    auto blockMoves = [&](double t) {
+      return measured(solvers, Operator::BlockMove, [&]() { return solvers.timedOptimizeBlockMove(sol.begin(), sol.end(), t, look); });
+    };
+    auto windows = [&](double t) {
+      return measured(solvers, Operator::Windows, [&]() { return solvers.timedOptimizeWindows(sol.begin(), sol.end(), windowSize, t, look); });
+    };
+
+    if(annealing) {
+      double temperature = annealTemperature * std::max(0.0, maxTime - elapsed()) / maxTime;
+      improvement += measured(solvers, Operator::Anneal, [&]() {
+        return solvers.anneal(sol.begin(), sol.end(), annealTime, temperature);
+      });
+      if(improvement > 0)
+        look.changed(0, sol.size());
+    }
+    else if(adaptiveScheduling) {
+      int a = scheduler.choose();
+      const Scheduler::Arm &arm = scheduler.arm(a);
+      switch(arm.op) {
+      case Operator::QuickSlice:
+      case Operator::JumpSlice:
+        do
+          improvement += slice(arm.op == Operator::JumpSlice, arm.radius);
+        while(elapsed() - t0 < scheduleQuantum);
+        break;
+      case Operator::Jump:
+        improvement += jumps(scheduleQuantum);
+        break;
+      case Operator::BlockMove:
+        improvement += blockMoves(scheduleQuantum);
+        break;
+      default:
+        improvement += windows(scheduleQuantum);
+      }
+      scheduler.reward(a, improvement, elapsed() - t0);
+    }
+    else {
+      if(hardInstance <= 0) {
+        // Quick improvement for easy-to-improve instances
+        double t = elapsed();
+        for(int k = 0; k < 5; k++)
+          improvement += slice(false);
+        t = elapsed() - t;
+
+        if(improvement == 0 || exact)
+          improvement += jumps(t/2);
+      }
+
+      if(improvement == 0 || exact) {
+        // Slower improvement when closer to optimal
+        for(int k = 0; k < 5; k++) {
+          double t = elapsed();
+          improvement += slice(true);
+          t = elapsed() - t;
+
+          // The jumps stop when the don't-look bits converge, and leave the
+          // rest of their time to the other operators
+          double tj = elapsed();
+          improvement += jumps(t/2);
+          double left = std::max(0.0, t/2 - (elapsed() - tj));
+          improvement += blockMoves(t/4 + left/2);
+          improvement += windows(t/4 + left/2);
+        }
+      }
+    }
+
+    solPool.spend(elapsed() - t0);
+    solPool.update(i, improvement); // Also if sideways moves changed the order
+    if(!annealing && !adaptiveScheduling)
+      hardInstance = improvement > 0 ? hardInstance - 1 : 16;
+
+    if(blockDone(solPool)) {
+      if(solPool.finish())
+        activeBlocks--;
+    }
+    else if(improvement > 0 && !solPool.overBudget())
+      queue.pushBack(w, item); // To work more time on better solutions
+    else
+      queue.pushFront(w, item);
+  }
 }
 
 int main(int argc, char **argv) {
-  struct sigaction action;
-  memset(&action, 0, sizeof(struct sigaction));
-  action.sa_handler = terminate;
-  sigaction(SIGTERM, &action, NULL);
-  sigaction(SIGINT, &action, NULL);
+  // SIGINT and SIGTERM are blocked in all threads, which inherit the mask,
+  // and taken by a thread that holds no lock when it calls terminate
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  std::thread([signals]() {
+    int signum;
+    sigwait(&signals, &signum);
+    terminate();
+  }).detach();
 
   if(argc >=2) {
     instfn = argv[1];
@@ -118,85 +530,193 @@ int main(int argc, char **argv) {
     solfn = argv[2];
   }
 
+  if(argc >=4) {
+    traceDest = argv[3];
+    if(!trace.open(traceDest))
+      std::cerr << "Cannot open the trace " << traceDest << std::endl;
+  }
+
   instance = Instance(instfn);
+  int nTwins = instance.reduceTwins();
+  blocks = Blocks(instance, minBlockSize);
   using Solversv = std::variant<Solvers<int, short int>, Solvers<int,int>, Solvers<i64,i64>>;
   Solversv solversv;
 
+  // The memory of the multilevel solutions is taken out of the matrix
+  size_t nMultilevel = 0;
+  for(auto &b : blocks.vertices)
+    nMultilevel += nSols > 2 && (int)b.size() > multilevelSize;
+  if(nMultilevel > 0)
+    multilevelMemory = std::min(multilevelMemory, memlimit / 4 / nMultilevel);
+  size_t matrixMemory = memlimit - nMultilevel * multilevelMemory;
+
   // Choose the right version of the Solvers template according to the instance size
-  if((i64) instance.v1Degree * instance.v1Degree < std::numeric_limits<short int>::max()) {
-    solversv = Solvers<int,short int>(memlimit);
+  if((i64) instance.v1WeightedDegree * instance.v1WeightedDegree < std::numeric_limits<short int>::max()) {
+    solversv = Solvers<int,short int>(matrixMemory, blocks);
   }
-  else if((i64) instance.v1Degree * instance.v1Degree < std::numeric_limits<int>::max()) {
-    solversv = Solvers<int,int>(memlimit);
+  else if((i64) instance.v1WeightedDegree * instance.v1WeightedDegree < std::numeric_limits<int>::max()) {
+    solversv = Solvers<int,int>(matrixMemory, blocks);
   }
   else {
-    solversv = Solvers<i64,i64>(memlimit);
+    solversv = Solvers<i64,i64>(matrixMemory, blocks);
   }
 
   if(showProgress) {
+    size_t largest = 0;
+    for(auto &b : blocks.vertices)
+      largest = std::max(largest, b.size());
     std::cout << "Read " << instfn << " with " << instance.n0 << " + " << instance.n1 << "(" << instance.v1.size() << ") vertices, " << instance.m << " edges, " << instance.v1Degree << " max degree " << std::endl;
+    std::cout << "Merged " << nTwins << " twins, " << blocks.size() << " blocks of at most " << largest << " vertices" << std::endl;
   }
 
 #ifdef EXACT
-  lowerBound = std::visit([](auto&& e){ return e.calcLowerBound(maxTime/2); }, solversv);
   bool exact = true;
 #else
-  // Do not waste time computing lower bound for large instances in heuristic mode
-  lowerBound = std::visit([](auto&& e){ return e.calcLowerBound(3); }, solversv);
   bool exact = false;
 #endif
 
-  SolPool solPool;
+  // The blocks one after the other are a valid solution, published before
+  // the pools are built so that a signal always finds one to output
+  Order *start = new Order;
+  for(auto &b : blocks.vertices)
+    start->insert(start->end(), b.begin(), b.end());
+  {
+    std::lock_guard lock(global_mutex);
+    global_best = start;
+  }
+  for(int b = 0, offset = 0; b < blocks.size(); offset += blocks.vertices[b].size(), b++)
+    pools.emplace_back(new SolPool(blocks.vertices[b], offset));
+  poolsReady = true;
+
+  trace.start(tracePeriod, [&solversv]() {
+    i64 bound = 0;
+    for(auto &pool : pools)
+      bound += pool->getLowerBound();
+    CacheStats stats = std::visit([](auto&& e){ return e.cacheStats(); }, solversv);
+    std::stringstream ss;
+    ss << "\"crossings\":" << global_crossings << ",\"lower\":" << std::max(bound, lowerBound.load())
+       << ",\"confidence\":" << confidenceCount() << ",\"solutions\":" << nSols
+       << ",\"fill\":" << (double) stats.bytes / memlimit;
+    return ss.str();
+  });
+
+  auto precompute = [&solversv]() {
+    double t = elapsed();
+    Precomputed p = std::visit([](auto&& e){
+      return e.precompute(precomputeTime, nThreads, precomputeBand, blocks, [](double fraction) {
+        if(showProgress && !precomputeBackground)
+          std::cout << " " << (int)(100 * fraction) << "%" << std::flush;
+      });
+    }, solversv);
+    for(int b = 0; b < blocks.size(); b++)
+      pools[b]->setLowerBound(p.blockBounds[b]);
+    lowerBound = p.lowerBound;
+    if(showProgress && !precomputeBackground)
+      std::cout << " " << (int)(100 * p.done) << "% in " << elapsed() - t << " seconds" << std::endl
+                << "Lower bound: " << lowerBound << std::endl;
+  };
+
+  std::thread precomputer;
+  if(precomputeBackground)
+    precomputer = std::thread(precompute);
+  else {
+    if(showProgress)
+      std::cout << "Computing the lower bound and the matrix:";
+    precompute();
+  }
 
   if(showProgress) {
-    std::cout << "Lower bound: " << lowerBound << std::endl;
     std::cout << "Best number of crossings so far (out of " << nSols << ")";
   }
 
-  std::visit([&solPool](auto&& e){ return fillSolutions(solPool, lowerBound, e); }, solversv);
+  TaskPool tasks(nThreads - 1);
+  taskPool = &tasks;
 
-  int hardInstance = 0;
+  std::visit([](auto&& e){ return fillSolutions(e); }, solversv);
+  if(precomputer.joinable()) {
+    precomputer.join();
+    if(showProgress)
+      std::cout << std::endl << "Lower bound: " << lowerBound;
+  }
 
-  // Main loop
-  do {
-    for(int i : solPool.getIndices()){
-      Order &sol = solPool[i];
-      i64 improvement = 0;
+  // Main loop, with the solutions of all blocks interleaved by rank
+  std::vector<int> items;
+  {
+    std::vector<std::vector<int>> indices;
+    for(int b = 0; b < blocks.size(); b++) {
+      if(blockDone(*pools[b]))
+        pools[b]->finish();
+      else {
+        activeBlocks++;
+        indices.push_back(pools[b]->getIndices());
+        for(int &i : indices.back())
+          i += b * nSols;
+      }
+    }
+    for(int r = 0; r < nSols; r++)
+      for(auto &v : indices)
+        if(r < (int)v.size())
+          items.push_back(v[r]);
+  }
 
-      if(hardInstance <= 0) {
-        // Quick improvement for easy-to-improve instances
-        double t = elapsed();
-        for(int i = 0; i < 5; i++) {
-          improvement += std::visit([&sol](auto&& e){return e.optimizeSlice(sol.begin(), sol.end(), false);}, solversv);
-        }
-        t = elapsed() - t;
+  // The branch and bound and the bounds run in two background threads within
+  // nThreads, which become workers when they are done, if there is a core left
+  int nWorkers = std::max(1, std::min(nThreads - 2, (int)items.size()));
+  int nLanes = std::max(nWorkers, std::min(nThreads, (int)items.size()));
+  WorkQueue queue(nLanes);
+  for(int k = 0; k < (int)items.size(); k++)
+    queue.pushFront(k % nWorkers, items[k]);
+  auto thenWork = [&queue, &solversv, nWorkers, nLanes, exact](int k) {
+    if(nWorkers + k < nLanes)
+      std::visit([&](auto&& e){ improveSolutions(queue, nWorkers + k, e, exact); }, solversv);
+  };
 
-        if(improvement == 0 || exact) {
-          improvement += std::visit([&sol, t](auto&& e){return e.timedOptimizeJump(sol.begin(), sol.end(), t/2);}, solversv);
-        }
-      }
+  // Each block gets a share of the worker time proportional to its size
+  double workerTime = nLanes * std::max(0.0, maxTime - elapsed());
+  for(auto &pool : pools)
+    pool->setBudget(workerTime * pool->size() / std::max<size_t>(1, instance.v1.size()));
 
-      if(improvement == 0 || exact) {
-        // Slower improvement when closer to optimal
-        for(int i = 0; i < 5; i++) {
-          double t = elapsed();
-          improvement += std::visit([&sol](auto&& e){return e.optimizeSlice(sol.begin(), sol.end(), true);}, solversv);
-          t = elapsed() - t;
+  std::thread exactSolver([&solversv, &thenWork]() {
+    std::visit([](auto&& e){ solveExactly(e); }, solversv);
+    thenWork(0);
+  });
+  std::thread boundSolver([&solversv, &thenWork]() {
+    std::visit([](auto&& e){ improveBounds(e); }, solversv);
+    thenWork(1);
+  });
 
-          improvement += std::visit([&sol, t](auto&& e){return e.timedOptimizeJump(sol.begin(), sol.end(), t/2);}, solversv);
-        }
-      }
+  std::vector<std::thread> workers;
+  for(int w = 0; w < nWorkers; w++) {
+    workers.emplace_back([&queue, &solversv, w, exact]() {
+      std::visit([&](auto&& e){ improveSolutions(queue, w, e, exact); }, solversv);
+    });
+  }
+  for(auto &t : workers)
+    t.join();
+  stopBackground = true;
+  exactSolver.join();
+  boundSolver.join();
 
-      if(improvement > 0) {
-        solPool.update(i, improvement);
-        break; // To work more time on better solutions
-      }
-      else {
-        hardInstance = 16;
-      }
+  if(showProgress) {
+    CacheStats stats = std::visit([](auto&& e){ return e.cacheStats(); }, solversv);
+    std::cout << std::endl << "Cost cache: " << 100 * stats.hitRate() << "% hits, "
+              << stats.bytes / 1e6 << " MB in " << stats.tiles << " tiles";
+    int nDistinct = 0, nSolutions = 0;
+    for(auto &pool : pools) {
+      nDistinct += pool->distinct();
+      nSolutions += pool->solutionCount();
+    }
+    std::cout << std::endl << "Distinct solutions: " << nDistinct << " out of " << nSolutions;
+    std::cout << std::endl << "Operators (calls, seconds, improvement, per ms, matrix hits):";
+    for(int op = 0; op < nOperators; op++) {
+      const OperatorStats &s = operatorStats[op];
+      if(s.calls == 0)
+        continue;
+      uint64_t lookups = s.hits + s.misses;
+      std::cout << std::endl << "  " << operatorNames[op] << ": " << s.calls << ", " << s.seconds << ", " << s.improvement
+                << ", " << (s.seconds > 0 ? s.improvement / (1000 * s.seconds) : 0) << ", " << (lookups ? 100.0 * s.hits / lookups : 0) << "%";
     }
-    hardInstance--;
-  } while(global_crossings > lowerBound && elapsed() < maxTime && global_nbest < nSols);
+  }
 
   terminate();
 
@@ -0,0 +1,107 @@
+#pragma once
+#include "solvers.hpp"
+#include <deque>
+
+// Initial orders of a large block by coarsening, solving and refining. Each
+// level merges the vertices of the finer one two by two, consecutive by
+// (median, average), so that vertices with similar neighborhoods end up
+// together, until at most coarseSize vertices are left. The coarsest order is
+// built by solveSplit and jumps. Going back, each vertex is expanded into its
+// pair, in the cheaper order, and the order is refined by jumps with don't-look
+// bits on the finer level. The levels are built once and reused by solve.
+// The caches of the levels share a memory budget: each level gets half of
+// what the finer ones left, as it has a quarter of their pairs.
+template<class S>
+class Multilevel {
+  struct Level {
+    Instance inst; // Vertices 0..size-1, one per group
+    std::vector<std::vector<int>> members; // Vertices of the finer level in each vertex
+    Solvers<i64,i64> solvers;
+
+    Level(const Instance &finer, std::vector<std::vector<int>> &&groups, size_t memory) :
+      inst(finer.coarsened(groups)), members(std::move(groups)), solvers(memory, Blocks(inst, inst.n1), inst) {}
+  };
+
+  S &solvers;
+  Order vertices;
+  std::deque<Level> levels; // Finest first; Level holds a pointer to its own instance
+
+public:
+  Multilevel(S &_solvers, const Order &_vertices, int coarseSize, size_t memory) : solvers(_solvers), vertices(_vertices) {
+    const Instance *finer = &instance;
+    Order current = vertices;
+    while((int)current.size() > coarseSize) {
+      std::sort(current.begin(), current.end(), [finer](int a, int b) {
+        const auto &ba = finer->bottom[a], &bb = finer->bottom[b];
+        return ba.median != bb.median ? ba.median < bb.median : ba.average < bb.average;
+      });
+      std::vector<std::vector<int>> groups;
+      for(size_t k = 0; k < current.size(); k += 2) {
+        groups.emplace_back(1, current[k]);
+        if(k + 1 < current.size())
+          groups.back().push_back(current[k + 1]);
+      }
+      memory /= 2;
+      Level &level = levels.emplace_back(*finer, std::move(groups), memory);
+      finer = &level.inst;
+      current = level.inst.v1;
+    }
+  }
+
+  int depth() const {
+    return levels.size();
+  }
+
+  // Bytes used by the caches of the levels
+  size_t memory() const {
+    size_t bytes = 0;
+    for(auto &level : levels)
+      bytes += level.solvers.cacheStats().bytes;
+    return bytes;
+  }
+
+  // A new order of the vertices in about t seconds, split among the levels in
+  // proportion to their size
+  Order solve(double t) {
+    if(levels.empty()) {
+      Order order(vertices);
+      solvers.solveSplit(order.begin(), order.end());
+      return order;
+    }
+    size_t total = vertices.size();
+    for(auto &level : levels)
+      total += level.inst.n1;
+    double perVertex = t / total;
+
+    Level &coarsest = levels.back();
+    Order order(coarsest.inst.v1);
+    std::shuffle(order.begin(), order.end(), rgen);
+    coarsest.solvers.solveSplit(order.begin(), order.end());
+    DontLook look(order.size());
+    coarsest.solvers.optimizeJump(order.begin(), order.end(), look, perVertex * order.size());
+
+    for(int l = levels.size() - 1; l >= 0; l--) {
+      if(l > 0)
+        order = expand(levels[l].members, order, levels[l - 1].solvers, perVertex);
+      else
+        order = expand(levels[l].members, order, solvers, perVertex);
+    }
+    return order;
+  }
+
+protected:
+  template<class T>
+  Order expand(const std::vector<std::vector<int>> &members, const Order &coarse, T &finer, double perVertex) {
+    Order order;
+    for(int v : coarse) {
+      const auto &g = members[v];
+      if(g.size() == 2 && finer.costDiff(g[0], g[1]) < 0)
+        order.insert(order.end(), {g[1], g[0]});
+      else
+        order.insert(order.end(), g.begin(), g.end());
+    }
+    DontLook look(order.size());
+    finer.optimizeJump(order.begin(), order.end(), look, perVertex * order.size());
+    return order;
+  }
+};
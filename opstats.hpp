@@ -0,0 +1,120 @@
+#pragma once
+#include "costcache.hpp"
+#include "instance.hpp"
+#include <atomic>
+#include <cmath>
+#include <mutex>
+#include <vector>
+
+// Operators of the workers, for the statistics and the scheduler
+enum class Operator { QuickSlice, JumpSlice, Jump, BlockMove, Windows, Anneal, Relink };
+constexpr int nOperators = 7;
+inline const char *operatorNames[nOperators] = {"slice", "slice+jump", "jump", "block move", "windows", "anneal", "relink"};
+
+// Last operator that improved a solution in this thread, for the trace
+inline thread_local const char *improvingOperator = "initial";
+
+// Totals of one operator over all workers
+struct OperatorStats {
+  std::atomic<uint64_t> calls = 0, hits = 0, misses = 0; // Matrix lookups
+  std::atomic<i64> improvement = 0;
+  std::atomic<double> seconds = 0;
+};
+
+inline OperatorStats operatorStats[nOperators];
+
+// Runs f, which returns an improvement, and adds it to the statistics of op
+template<class S, class F>
+i64 measured(S &solvers, Operator op, F &&f) {
+  CacheStats c0 = solvers.threadCacheStats();
+  double t0 = elapsed();
+  i64 improvement = f();
+  CacheStats c1 = solvers.threadCacheStats();
+  OperatorStats &s = operatorStats[(int)op];
+  s.calls++;
+  s.seconds += elapsed() - t0;
+  s.improvement += improvement;
+  s.hits += c1.hits - c0.hits;
+  s.misses += c1.misses - c0.misses;
+  if(improvement > 0)
+    improvingOperator = operatorNames[(int)op];
+  return improvement;
+}
+
+// Choice of an operator (and of the radius of the slices) by a discounted
+// UCB1 bandit. The reward of an arm is its improvement per second, relative to
+// the best arm, and each new reward discounts the older ones, so that the
+// choice follows the operators that still pay off as the solutions converge.
+// Arms that were never chosen come first. A pull counts when the arm is
+// chosen, so that workers that choose before any reward try different arms.
+class Scheduler {
+public:
+  struct Arm {
+    Operator op;
+    int radius; // Of the slices, 0 for the other operators
+  };
+
+private:
+  static constexpr double discount = 0.995;
+  static constexpr double exploration = 0.5;
+
+  std::mutex m;
+  std::vector<Arm> arms;
+  std::vector<double> pulls, gains, seconds; // Discounted sums
+  double totalPulls = 0;
+
+public:
+  Scheduler() {
+    for(int r : {10, 20, 30})
+      arms.push_back({Operator::QuickSlice, r * r});
+    for(int r : {8, 13, 18})
+      arms.push_back({Operator::JumpSlice, r * r});
+    for(Operator op : {Operator::Jump, Operator::BlockMove, Operator::Windows})
+      arms.push_back({op, 0});
+    pulls.assign(arms.size(), 0);
+    gains.assign(arms.size(), 0);
+    seconds.assign(arms.size(), 0);
+  }
+
+  const Arm &arm(int a) const {
+    return arms[a];
+  }
+
+  int choose() {
+    std::lock_guard lock(m);
+    int best = -1;
+    double bestRate = 0;
+    for(size_t a = 0; a < arms.size() && best < 0; a++) {
+      if(pulls[a] == 0)
+        best = a;
+      else
+        bestRate = std::max(bestRate, gains[a] / std::max(seconds[a], 1e-9));
+    }
+    if(best < 0) {
+      double bestScore = -1;
+      for(size_t a = 0; a < arms.size(); a++) {
+        double rate = bestRate > 0 ? gains[a] / std::max(seconds[a], 1e-9) / bestRate : 0;
+        double score = rate + exploration * std::sqrt(std::log(totalPulls) / pulls[a]);
+        if(score > bestScore) {
+          bestScore = score;
+          best = a;
+        }
+      }
+    }
+    for(size_t b = 0; b < arms.size(); b++) {
+      pulls[b] *= discount;
+      gains[b] *= discount;
+      seconds[b] *= discount;
+    }
+    totalPulls = totalPulls * discount + 1;
+    pulls[best] += 1;
+    return best;
+  }
+
+  // Adds the result of a pull of a, counted when it was chosen
+  void reward(int a, i64 improvement, double t) {
+    std::lock_guard lock(m);
+    gains[a] += improvement;
+    seconds[a] += t;
+  }
+};
@@ -1,43 +1,162 @@
 #pragma once
 #include "solution.hpp"
+#include "dontlook.hpp"
+#include "trace.hpp"
 #include <map>
 #include <set>
+#include <atomic>
+#include <mutex>
+#include <limits>
 
+// The global best is the concatenation of the best orders of all blocks. It
+// is read by the termination checks of all workers without locking, and
+// updated under global_mutex
 Order *global_best = nullptr;
-i64 global_crossings;
-int global_nbest = 0;
+std::atomic<i64> global_crossings = 0;
+std::mutex global_mutex;
 Instance instance;
 bool showProgress = false;
 
 
+// Solutions for one block, whose vertices are at [offset, offset + size) in
+// the global best
 class SolPool {
   std::vector<std::pair<Order,i64>> solutions;
+  std::vector<DontLook> looks; // Of each solution
+  std::vector<uint64_t> hashes; // Of each order (see orderHash)
+  std::vector<int> restarts; // Times each solution was replaced as a duplicate
+  std::map<uint64_t,Order> elites; // Copies of different orders with the fewest crossings, by hash
+  i64 eliteCrossings = -1;
+  static constexpr size_t maxElites = 4;
   std::map<i64,std::set<int>> crossMap;
+  mutable std::mutex m; // Protects the ranking, not the orders themselves
+  Order initial;
+  int offset = 0;
+  std::atomic<i64> best; // Crossings of the block in the global best
+  std::atomic<i64> lowerBound = 0;
+  std::atomic<int> nbest = 0; // Number of solutions as good as the best
+  std::atomic<double> spent = 0; // Seconds spent improving the solutions
+  double budget = std::numeric_limits<double>::infinity();
+  std::atomic<bool> finished = false;
 
 public:
+  // Starts with the vertices in the given order as the best
+  SolPool(const Order &vertices, int _offset) : initial(vertices), offset(_offset) {
+    best = crossings(instance, initial.begin(), initial.end());
+    std::lock_guard lock(global_mutex);
+    std::copy(initial.begin(), initial.end(), global_best->begin() + offset);
+    global_crossings += best;
+  }
+
   int insert(Order &sol, i64 cr = -1) {
     if(cr < 0)
       cr = crossings(instance, sol.begin(), sol.end());
+    std::lock_guard lock(m);
     int index = solutions.size();
     solutions.push_back(std::make_pair(sol,cr));
+    looks.emplace_back(sol.size());
+    hashes.push_back(orderHash(sol.begin(), sol.end()));
+    restarts.push_back(0);
     crossMap[cr].insert(index);
+    keepElite(index);
     updateGlobal(sol, cr);
     return index;
   }
 
+  // Only the worker currently holding the solution may call this, also after
+  // moves that did not improve (to update its hash)
   void update(int index, i64 improvement) {
-    i64 &cr = solutions.at(index).second;
-    crossMap[cr].erase(index);
-    if(crossMap[cr].empty())
-      crossMap.erase(cr);
-    cr -= improvement;
+    Order &sol = solutions.at(index).first;
+    uint64_t h = orderHash(sol.begin(), sol.end());
+    std::lock_guard lock(m);
+    hashes[index] = h;
+    i64 &cr = solutions[index].second;
+    if(improvement != 0) {
+      crossMap[cr].erase(index);
+      if(crossMap[cr].empty())
+        crossMap.erase(cr);
+      cr -= improvement;
+      crossMap[cr].insert(index);
+      keepElite(index);
+      updateGlobal(sol, cr);
+    }
+    else {
+      keepElite(index);
+      if(cr == best)
+        nbest = countBest();
+    }
+  }
+
+  // True if another solution with a smaller index has the same order, and
+  // this one was never replaced
+  bool duplicate(int index) const {
+    std::lock_guard lock(m);
+    return toReplace(index);
+  }
 
+  // True if there are at least n solutions, all with the same crossings, and
+  // none is left to replace: the ones that repeated an order were replaced
+  // and came back to the best. Then the block has converged even if few of
+  // the orders are different.
+  bool agreed(int n) const {
+    std::lock_guard lock(m);
+    if((int)solutions.size() < n || crossMap.size() != 1)
+      return false;
+    for(int index = 0; index < (int)solutions.size(); index++)
+      if(toReplace(index))
+        return false;
+    return true;
+  }
+
+  // Replaces a duplicate by another order, as update
+  void replace(int index, Order &sol) {
+    i64 cr = crossings(instance, sol.begin(), sol.end());
+    uint64_t h = orderHash(sol.begin(), sol.end());
+    Order &old = solutions.at(index).first;
+    std::copy(sol.begin(), sol.end(), old.begin());
+    looks[index].reset(sol.size());
+    std::lock_guard lock(m);
+    hashes[index] = h;
+    restarts[index]++;
+    i64 &oldcr = solutions[index].second;
+    crossMap[oldcr].erase(index);
+    if(crossMap[oldcr].empty())
+      crossMap.erase(oldcr);
+    oldcr = cr;
     crossMap[cr].insert(index);
-    updateGlobal(solutions[index].first, cr);
+    keepElite(index);
+    nbest = countBest();
+    updateGlobal(old, cr);
+  }
+
+  // Copies of two different orders with the fewest crossings, picked at
+  // random, or empty orders if there are not two of them
+  std::pair<Order,Order> elitePair() const {
+    std::lock_guard lock(m);
+    if(elites.size() < 2)
+      return {};
+    std::uniform_int_distribution<int> pick(0, elites.size() - 1);
+    int a = pick(rgen), b = pick(rgen);
+    while(b == a)
+      b = pick(rgen);
+    return {std::next(elites.begin(), a)->second, std::next(elites.begin(), b)->second};
+  }
+
+  int solutionCount() const {
+    std::lock_guard lock(m);
+    return solutions.size();
+  }
+
+  // Number of different orders
+  int distinct() const {
+    std::lock_guard lock(m);
+    std::set<uint64_t> s(hashes.begin(), hashes.end());
+    return s.size();
   }
 
   std::vector<int> getIndices() const {
     std::vector<int> indices;
+    std::lock_guard lock(m);
     for(auto &[_,iset] : crossMap) {
       std::vector<int> v(iset.begin(),iset.end());
       std::shuffle(v.begin(), v.end(), rgen);
@@ -46,30 +165,137 @@ public:
     return indices;
   }
 
+  // Copy of the best solution, which may be read while workers improve the
+  // solutions
+  Order bestOrder() const {
+    std::lock_guard lock(global_mutex);
+    return Order(global_best->begin() + offset, global_best->begin() + offset + size());
+  }
+
+  i64 bestCrossings() const {
+    return best;
+  }
+
   Order &operator[](int index) {
     return solutions.at(index).first;
   }
 
+  DontLook &look(int index) {
+    return looks.at(index);
+  }
+
+  const Order &vertices() const {
+    return initial;
+  }
+
+  int size() const {
+    return initial.size();
+  }
+
+  int nBest() const {
+    return nbest;
+  }
+
+  // Bounds come from several threads, so only the largest one is kept
+  void setLowerBound(i64 lb) {
+    i64 cur = lowerBound;
+    while(cur < lb && !lowerBound.compare_exchange_weak(cur, lb));
+  }
+
+  i64 getLowerBound() const {
+    return lowerBound;
+  }
+
+  // Replaces the best solution by one proven optimal elsewhere, without
+  // changing the solutions that the workers improve
+  void setOptimal(const Order &sol, i64 cr) {
+    std::lock_guard lock(global_mutex);
+    if(cr < best) {
+      std::copy(sol.begin(), sol.end(), global_best->begin() + offset);
+      global_crossings += cr - best;
+      best = cr;
+      trace.improved(global_crossings, offset, nbest);
+      if(showProgress)
+        std::cout << " -> " << global_crossings << std::flush;
+    }
+    setLowerBound(cr);
+  }
+
+  bool optimal() const {
+    return best <= lowerBound;
+  }
+
+  // Time accounting, so that the workers can favor the blocks that got less
+  // than their share
+  void setBudget(double seconds) {
+    budget = seconds;
+  }
+
+  void spend(double seconds) {
+    spent += seconds;
+  }
+
+  bool overBudget() const {
+    return spent > budget;
+  }
+
+  // Returns true only for the first call
+  bool finish() {
+    return !finished.exchange(true);
+  }
+
 protected:
-  void updateGlobal(Order &sol, i64 cr) const {
-    if(global_best == nullptr || cr <= global_crossings) {
-      auto tmp = global_best;
-      global_best = new Order(sol);
-      global_crossings = cr;
-      global_nbest = crossMap.begin()->second.size();
-      delete tmp;
-      if(showProgress) {
-        std::cout << " -> " << global_crossings;
-        if(global_nbest > 1)
-          std::cout << "(" << global_nbest << ")";
-        std::cout << std::flush;
-      }
-      // Uncomment to output progress stats
-      // if(showProgress) {
-      //   std::cerr << elapsed() << " " << global_crossings << std::endl;
-      // }
+  // Keeps a copy of the order of a solution with the fewest crossings, if it
+  // is new. The copies are dropped when the fewest crossings change. Called
+  // under m by the worker holding the solution.
+  void keepElite(int index) {
+    i64 top = crossMap.begin()->first;
+    if(top != eliteCrossings) {
+      elites.clear();
+      eliteCrossings = top;
     }
+    if(solutions[index].second == top && elites.size() < maxElites && !elites.count(hashes[index]))
+      elites.emplace(hashes[index], solutions[index].first);
   }
-};
 
+  bool toReplace(int index) const {
+    if(restarts.at(index) > 0)
+      return false;
+    for(int j = 0; j < index; j++)
+      if(hashes[j] == hashes[index])
+        return true;
+    return false;
+  }
 
+  // Number of different orders as good as the best. A replaced solution that
+  // reaches an order again does not count twice (its replacements are counted
+  // in restarts).
+  int countBest() const {
+    const auto &iset = crossMap.begin()->second;
+    std::set<uint64_t> seen;
+    for(int index : iset)
+      seen.insert(hashes[index]);
+    return seen.size();
+  }
+
+  void updateGlobal(Order &sol, i64 cr) {
+    std::lock_guard lock(global_mutex);
+    if(cr <= best) {
+      int oldNBest = nbest;
+      bool improved = cr < best;
+      std::copy(sol.begin(), sol.end(), global_best->begin() + offset);
+      global_crossings += cr - best;
+      best = cr;
+      nbest = countBest();
+      if(improved || (nbest > 1 && nbest != oldNBest)) {
+        trace.improved(global_crossings, offset, nbest);
+        if(showProgress) {
+          std::cout << " -> " << global_crossings;
+          if(nbest > 1)
+            std::cout << "(" << nbest << ")";
+          std::cout << std::flush;
+        }
+      }
+    }
+  }
+};
@@ -2,9 +2,11 @@
 #include <utility>
 #include <algorithm>
 #include <vector>
-#include <unordered_set>
+#include <string>
+#include <thread>
 #include "instance.hpp"
 #include "segtree.hpp"
+#include "fenwick.hpp"
 
 using Coords = std::vector<int>;
 using Order = std::vector<int>;
@@ -53,17 +55,42 @@ Coords toCoords(Instance &inst, Order &order) {
   return ret;
 }
 
+// Hash of an order, as the sum of a hash of each pair of consecutive
+// vertices (and of the first vertex), which determine the order. A jump only
+// changes three pairs, so it could be updated incrementally.
+inline uint64_t orderHash(std::vector<int>::const_iterator begin, std::vector<int>::const_iterator end) {
+  auto pairHash = [](int u, int v) {
+    uint64_t x = (uint64_t)(uint32_t)u << 32 | (uint32_t)v;
+    return splitmix(x);
+  };
+  uint64_t h = 0;
+  for(int prev = -1; begin != end; prev = *begin++)
+    h += pairHash(prev, *begin);
+  return h;
+}
+
+// Twins merged into a vertex of the order are written right after it
 template<class STREAM>
 void printOrSave(Instance &inst, Order &ord, STREAM &stream) {
-  std::unordered_set<int> listed;
+  std::vector<char> listed(inst.n1, 0);
+  std::string out;
+  out.reserve(12 * (size_t) inst.n1);
+  auto put = [&](int v) {
+    out += std::to_string(inst.n0 + v + 1);
+    out += '\n';
+    listed[v] = 1;
+  };
   for(const auto &v : ord) {
-    stream << inst.n0 + v + 1 << std::endl;
-    listed.insert(v);
+    put(v);
+    for(int u : inst.twins[v])
+      put(u);
   }
   for(int v = 0; v < inst.n1; v++) {
-    if(!listed.contains(v))
-      stream << inst.n0 + v + 1 << std::endl;
+    if(!listed[v])
+      put(v);
   }
+  stream.write(out.data(), out.size());
+  stream.flush();
 }
 
 void save(Instance &inst, Order &ord, std::string fn) {
@@ -78,58 +105,176 @@ void print(Instance &inst, Order &ord) {
 Order load(Instance &inst, std::string fn) {
   std::ifstream f(fn);
   Order sol;
-  while (true) {
-    int x;
-    f >> x;
-    if( f.eof() ) break;
+  int x;
+  while(f >> x) // Also if the last line has no newline
     sol.push_back(x - inst.n0 - 1);
-  }
   return sol;
 }
 
-i64 crossingsC(Instance &inst, Coords coords) {
-  normalizeC(coords);
-  std::vector<int> v(inst.n1,0);
+// Algorithm used by crossings(). The MergeSort engine uses crossingThreads
+// threads and is meant for counting whole solutions.
+enum class CrossingEngine { Segtree, Fenwick, MergeSort };
+CrossingEngine crossingEngine = CrossingEngine::Fenwick;
+int crossingThreads = 1;
+
+i64 crossingsSegtree(Instance &inst, std::vector<int>::iterator begin, std::vector<int>::iterator end) {
+  std::vector<int> v(inst.n0,0);
   Segtree<int> tree(v.data(), v.data() + v.size());
   i64 ret = 0;
-  for(int top = inst.n0-1; top >= 0; top--) {
-    for(int bottom : inst.adj[top]) {
-      int y = coords[bottom-inst.n0];
-      ret += tree.query(0, y);
+
+  for(auto bottom = end-1; bottom != begin-1; bottom--) {
+    int w = inst.bottom[*bottom].weight;
+    for(int top : inst.adj(*bottom+inst.n0)) {
+      ret += (i64)w * tree.query(0, top);
     }
-    for(int bottom : inst.adj[top]) {
-      int y = coords[bottom-inst.n0];
-      v.at(y)++;
-      tree.update(y,v[y]);
+    for(int top : inst.adj(*bottom+inst.n0)) {
+      v.at(top) += w;
+      tree.update(top, v[top]);
     }
+    ret += inst.twinCrossingsOf(*bottom);
   }
+
   return ret;
 }
 
-i64 crossings(Instance &inst, std::vector<int>::iterator begin, std::vector<int>::iterator end) {
-  std::vector<int> v(inst.n0,0);
-  Segtree<int> tree(v.data(), v.data() + v.size());
+// Same as crossingsSegtree, with a tree restricted to the range of the top
+// vertices adjacent to the slice
+i64 crossingsFenwick(Instance &inst, std::vector<int>::iterator begin, std::vector<int>::iterator end) {
+  int lo = inst.n0, hi = -1;
+  for(auto bottom = begin; bottom != end; ++bottom) {
+    lo = std::min(lo, inst.bottom[*bottom].front);
+    hi = std::max(hi, inst.bottom[*bottom].back);
+  }
+  if(hi < lo)
+    return 0;
+
+  Fenwick<int> tree(hi - lo + 1);
   i64 ret = 0;
+  for(auto bottom = end; bottom != begin; ) {
+    --bottom;
+    auto tops = inst.adj(*bottom+inst.n0);
+    int w = inst.bottom[*bottom].weight;
+    for(int top : tops)
+      ret += (i64)w * tree.prefix(top - lo);
+    for(int top : tops)
+      tree.add(top - lo, w);
+    ret += inst.twinCrossingsOf(*bottom);
+  }
 
-  for(auto bottom = end-1; bottom != begin-1; bottom--) {
-    for(int top : inst.adj[*bottom+inst.n0]) {
-      ret += tree.query(0, top);
+  return ret;
+}
+
+// Merges the sorted ranges a and b into out and returns the number of pairs
+// (x in a, y in b) with x > y
+i64 mergeInversions(const int *a, int na, const int *b, int nb, int *out) {
+  i64 ret = 0;
+  int ia = 0, ib = 0;
+  while(ia < na && ib < nb) {
+    if(a[ia] <= b[ib])
+      *out++ = a[ia++];
+    else {
+      ret += na - ia;
+      *out++ = b[ib++];
     }
-    for(int top : inst.adj[*bottom+inst.n0]) {
-      v.at(top)++;
-      tree.update(top, v[top]);
+  }
+  out = std::copy(a + ia, a + na, out);
+  std::copy(b + ib, b + nb, out);
+  return ret;
+}
+
+// Sorts a (bottom-up merge sort) and returns its number of inversions
+i64 sortInversions(int *a, int *tmp, int n) {
+  i64 ret = 0;
+  for(int w = 1; w < n; w *= 2) {
+    for(int lo = 0; lo < n; lo += 2 * w) {
+      int mid = std::min(lo + w, n), hi = std::min(lo + 2 * w, n);
+      ret += mergeInversions(a + lo, mid - lo, a + mid, hi - mid, tmp + lo);
     }
+    std::copy(tmp, tmp + n, a);
+  }
+  return ret;
+}
+
+// The crossings are the inversions of the sequence of the top vertices of the
+// edges sorted by bottom position (the list of a merged vertex is repeated
+// for each twin). Chunks of the sequence are sorted by
+// different threads, and then merged pairwise in parallel.
+i64 crossingsMergeSort(Instance &inst, std::vector<int>::iterator begin, std::vector<int>::iterator end, int nThreads) {
+  std::vector<int> tops;
+  for(auto bottom = begin; bottom != end; ++bottom) {
+    auto a = inst.adj(*bottom+inst.n0);
+    for(int k = 0; k < inst.bottom[*bottom].weight; k++)
+      tops.insert(tops.end(), a.begin(), a.end());
+  }
+  int m = tops.size();
+  std::vector<int> tmp(m);
+
+  int nChunks = std::max(1, std::min(nThreads, m / 4096));
+  std::vector<int> bounds;
+  for(int k = 0; k <= nChunks; k++)
+    bounds.push_back((i64) m * k / nChunks);
+
+  std::vector<i64> counts(nChunks, 0);
+  auto parallel = [](int n, auto f) {
+    std::vector<std::thread> threads;
+    for(int k = 1; k < n; k++)
+      threads.emplace_back(f, k);
+    f(0);
+    for(auto &t : threads)
+      t.join();
+  };
+
+  parallel(nChunks, [&](int k) {
+    counts[k] = sortInversions(tops.data() + bounds[k], tmp.data() + bounds[k], bounds[k+1] - bounds[k]);
+  });
+
+  while(counts.size() > 1) {
+    int nPairs = counts.size() / 2;
+    std::vector<int> merged;
+    std::vector<i64> mergedCounts(nPairs);
+    parallel(nPairs, [&](int k) {
+      int lo = bounds[2*k], mid = bounds[2*k+1], hi = bounds[2*k+2];
+      mergedCounts[k] = counts[2*k] + counts[2*k+1] +
+        mergeInversions(tops.data() + lo, mid - lo, tops.data() + mid, hi - mid, tmp.data() + lo);
+      std::copy(tmp.data() + lo, tmp.data() + hi, tops.data() + lo);
+    });
+    for(int k = 0; k < (int)counts.size(); k += 2)
+      merged.push_back(bounds[k]);
+    if(counts.size() % 2 == 1)
+      mergedCounts.push_back(counts.back());
+    merged.push_back(m);
+    bounds = merged;
+    counts = mergedCounts;
   }
 
+  i64 ret = 0;
+  for(i64 c : counts)
+    ret += c;
   return ret;
 }
 
+i64 crossings(Instance &inst, std::vector<int>::iterator begin, std::vector<int>::iterator end) {
+  switch(crossingEngine) {
+    case CrossingEngine::Segtree:
+      return crossingsSegtree(inst, begin, end);
+    case CrossingEngine::MergeSort:
+      return crossingsMergeSort(inst, begin, end, crossingThreads);
+    default:
+      return crossingsFenwick(inst, begin, end);
+  }
+}
+
+i64 crossingsC(Instance &inst, Coords coords) {
+  Order order = toOrder(coords);
+  return crossings(inst, order.begin(), order.end());
+}
+
 // This version could be faster for small slices, but does not seem to be
 //
 // i64 crossingsSmall(Instance &inst, std::vector<int>::iterator begin, std::vector<int>::iterator end) {
 //   std::map<int, int> relTop;
 //   for(auto bottom = begin; bottom != end; bottom++)
-//     for(int x : inst.adj[*bottom+inst.n0])
+//     for(int x : inst.adj(*bottom+inst.n0))
 //       relTop[x] = -1;
 //
 //   {
@@ -144,10 +289,10 @@ i64 crossings(Instance &inst, std::vector<int>::iterator begin, std::vector<int>
 //   i64 ret = 0;
 //
 //   for(auto bottom = end-1; bottom != begin-1; bottom--) {
-//     for(int top : inst.adj[*bottom+inst.n0]) {
+//     for(int top : inst.adj(*bottom+inst.n0)) {
 //       ret += tree.query(0, relTop[top]);
 //     }
-//     for(int top : inst.adj[*bottom+inst.n0]) {
+//     for(int top : inst.adj(*bottom+inst.n0)) {
 //       int i = relTop[top];
 //       v.at(i)++;
 //       tree.update(i, v[i]);
@@ -2,121 +2,236 @@
 
 #include "instance.hpp"
 #include "solution.hpp"
+#include "costcache.hpp"
+#include "kernels.hpp"
+#include "blocks.hpp"
+#include "dontlook.hpp"
+#include "taskpool.hpp"
+#include <memory>
+#include <cmath>
+#include <thread>
+#include <mutex>
+
+struct Precomputed {
+  i64 lowerBound = 0;
+  std::vector<i64> blockBounds; // Lower bound of each block
+  double done = 0; // Fraction of the vertices whose pairs were all computed
+};
 
 template<class DT, class DTM>
 class Solvers {
-  DTM *matrix = nullptr;
-  int maxcoord = 0;
-  size_t msize = 0;
+  static constexpr int maxInversionsPerEdge = 4; // Above that, reorderDelta recounts
+  static constexpr int maxBlockMove = 8; // Longest block moved by timedOptimizeBlockMove
+  static constexpr int maxWindow = 20; // Longest window of optimizeWindow, which uses O(2^size) memory
+  static constexpr int parallelSplitSize = 1 << 13; // Smallest part split by parallel tasks
+  static constexpr int shortScan = 32; // Scans of blockGains shorter than this do not use a Column
+
+  // Buffers of the operators, reused by each thread
+  struct Scratch {
+    Order slice;
+    std::vector<int> pos, seq, tmp;
+    std::vector<i64> gains; // Of jumpVertex
+    std::vector<i64> dp, half; // Of optimizeWindow
+    std::vector<uint8_t> last;
+    std::vector<std::pair<int,int>> moves; // Of anneal and relink
+    std::vector<double> weights;
+    typename CostCache<DTM>::ColumnTiles columnTiles;
+  };
+
+  static Scratch &scratch() {
+    thread_local Scratch sc;
+    return sc;
+  }
+
+  Instance *inst = &instance;
+  std::unique_ptr<CostCache<DTM>> cache;
+  std::vector<int> key; // Index of each bottom vertex in the cache
 
 public:
+  using Guard = typename CostCache<DTM>::Guard;
+  using Column = typename CostCache<DTM>::Column;
+
   Solvers(){}
 
-  Solvers(size_t memlimit) {
-    maxcoord = sqrt(memlimit / sizeof(DTM));
-    if(maxcoord > instance.n1)
-      maxcoord = instance.n1;
-    msize = (size_t)maxcoord*maxcoord;
-    matrix = new DTM[msize];
-    for(size_t i = 0; i < msize; i++)
-      matrix[i] = std::numeric_limits<DTM>::max();
-  }
-
-  DT calculateCostDiff(int i, int j) {
-    DT c1 = 0, c2 = 0;
-    auto &ai = instance.adj[instance.n0+i];
-    auto &aj = instance.adj[instance.n0+j];
-    auto itj = aj.begin();
-
-    for(auto iti = ai.begin(); iti != ai.end(); ++iti) {
-      bool first = true;
-      for(; itj != aj.end(); ++itj) {
-        if(first && *itj >= *iti) {
-          c2 += itj - aj.begin();
-          first = false;
-        }
-        if(*itj > *iti) {
-          c1 += aj.end() - itj;
-          break;
-        }
-      }
-      if(first)
-        c2 += aj.size();
-    }
+  // Only pairs whose neighbor intervals overlap are cached. The vertices are
+  // numbered by block and then by the middle of their interval, so that these
+  // pairs fall into the tiles around the diagonal and no other tile is ever
+  // allocated. Each block thus uses its own square of the matrix. The costs
+  // are those of the global instance, unless another one is given.
+  Solvers(size_t memlimit, const Blocks &blocks, Instance &_inst = instance) : inst(&_inst), cache(new CostCache<DTM>(inst->n1, memlimit)), key(inst->n1) {
+    std::vector<std::tuple<int,i64,int>> mids;
+    for(int i = 0; i < inst->n1; i++)
+      mids.push_back(std::make_tuple(blocks.of[i], (i64)inst->bottom[i].front + inst->bottom[i].back, i));
+    std::sort(mids.begin(), mids.end());
+    for(int k = 0; k < inst->n1; k++)
+      key[std::get<2>(mids[k])] = k;
+  }
 
-    return c1-c2;
+  CacheStats cacheStats() const {
+    return cache->stats();
   }
 
-  DT calculateCostMin(int i, int j) {
-    DT c1 = 0, c2 = 0;
-    auto &ai = instance.adj[instance.n0+i];
-    auto &aj = instance.adj[instance.n0+j];
-    const auto aje = aj.end();
-    auto itj = aj.begin();
+  CacheStats threadCacheStats() const {
+    return cache->threadStats();
+  }
 
-    for(auto iti = ai.begin(); iti != ai.end(); ++iti) {
-      bool first = true;
-      for(; itj != aje; ++itj) {
-        if(first && *itj >= *iti) {
-          c2 += itj - aj.begin();
-          first = false;
-        }
-        if(*itj > *iti) {
-          c1 += aj.end() - itj;
-          break;
-        }
-      }
-      if(first)
-        c2 += aj.size();
+  // Costs scaled by the weights, as every twin of i crosses every twin of j
+  CostPair calculateCosts(int i, int j) const {
+    CostPair p;
+    if(inst->repeated) {
+      auto ai = inst->adj(inst->n0+i), aj = inst->adj(inst->n0+j);
+      p = costPairRepeated(ai.data(), ai.size(), aj.data(), aj.size());
+    }
+    else if(inst->narrow) {
+      auto ai = inst->narrowAdj(i), aj = inst->narrowAdj(j);
+      p = costPair(ai.data(), ai.size(), aj.data(), aj.size());
+    }
+    else {
+      auto ai = inst->adj(inst->n0+i), aj = inst->adj(inst->n0+j);
+      p = costPair(ai.data(), ai.size(), aj.data(), aj.size());
     }
+    i64 w = (i64)inst->bottom[i].weight * inst->bottom[j].weight;
+    return {p.c1 * w, p.c2 * w};
+  }
 
-    return std::min(c1,c2);
+  DT calculateCostDiff(int i, int j) const {
+    CostPair p = calculateCosts(i, j);
+    return p.c1 - p.c2;
   }
 
-  DT costDiff(int i, int j) {
-    if(i < maxcoord && j < maxcoord) {
-      if(matrixAt(i,j) == std::numeric_limits<DTM>::max()) {
-        DT x = calculateCostDiff(i,j);
-        matrixAt(i,j) = x;
-        matrixAt(j,i) = -x;
-        return x;
-      }
-      return matrixAt(i,j);
+  // If the order of the pair is forced (see Instance::forcedBefore), the
+  // cost of the other order is the product of the (weighted) degrees, minus
+  // the pair of edges sharing the top vertex where the intervals touch (which
+  // is counted normally if the lists may repeat it)
+  bool forcedCostDiff(int i, int j, DT &x) const {
+    const auto &bi = inst->bottom[i], &bj = inst->bottom[j];
+    if(inst->repeated && (bi.back == bj.front || bj.back == bi.front))
+      return false;
+    if(inst->forcedBefore(i, j)) {
+      x = ((DT)bi.degree * bj.degree - (bi.back == bj.front)) * bi.weight * bj.weight;
+      return true;
+    }
+    if(inst->forcedBefore(j, i)) {
+      x = -((DT)bi.degree * bj.degree - (bj.back == bi.front)) * bi.weight * bj.weight;
+      return true;
     }
-    return calculateCostDiff(i,j);
+    return false;
   }
 
-  DTM &matrixAt(int i, int j) {
-    return matrix[i + (size_t)maxcoord*j];
+  // The cache is shared by all worker threads. Loops doing many lookups
+  // should hold a guard and use the other versions.
+  DT costDiff(int i, int j) {
+    auto guard = cache->guard();
+    return costDiff(i, j, guard);
   }
 
-  i64 calcLowerBound(double t = -1) {
-    i64 ret = 0;
-    double t0 = elapsed();
+  DT costDiff(int i, int j, Guard &guard) {
+    DT y;
+    if(forcedCostDiff(i, j, y))
+      return y;
+    DTM x;
+    if(cache->lookup(key[i], key[j], x, guard))
+      return x;
+    y = calculateCostDiff(i,j);
+    cache->store(key[i], key[j], y);
+    return y;
+  }
 
-    for(int i = 0; i < instance.n1 - 1; i++) {
-      for(int j = i+1; j < instance.n1; j++)
-        ret += calculateCostMin(i,j);
-      if(t > 0 && elapsed() - t0 > t)
-        return ret;
-    }
-    return ret;
+  Guard guard() {
+    return cache->guard();
   }
 
-  int median(const std::vector<int> &v) {
-    if(v.empty())
-      return 0;
-    return v[v.size() / 2];
+  Column column(int j, Guard &guard) {
+    return Column(*cache, key[j], guard, scratch().columnTiles);
   }
 
-  double average(const std::vector<int> &v) {
-    if(v.empty())
-      return 0;
-    double sum = 0.0;
-    for(int i : v)
-      sum += i;
+  // Same as costDiff(i, j) for the j of the column
+  DT costDiff(int i, int j, Column &column) {
+    DT y;
+    if(forcedCostDiff(i, j, y))
+      return y;
+    DTM x;
+    if(column.lookup(key[i], x))
+      return x;
+    y = calculateCostDiff(i,j);
+    column.store(key[i], y);
+    return y;
+  }
+
+  // Single pass over the pairs of overlapping vertices using nThreads
+  // threads: adds min(c1,c2) of each pair to the lower bound of the block of
+  // the pair (forced pairs add 0, twins add their constant crossings) and
+  // stores the cost difference in the cache until it is full. If band > 0,
+  // only pairs at most band apart in the cache numbering are stored.
+  // Stops after t seconds, in which case the bounds only cover the vertices
+  // done so far, but are still valid.
+  // Calls progress(fraction) from the calling thread about once per second.
+  template<class F>
+  Precomputed precompute(double t, int nThreads, int band, const Blocks &blocks, F &&progress) {
+    // Overlapping pairs (i,j) with i first in this order have j in a contiguous range
+    std::vector<std::pair<int,int>> byFront;
+    for(int i : inst->v1)
+      byFront.push_back(std::make_pair(inst->bottom[i].front, i));
+    std::sort(byFront.begin(), byFront.end());
+    std::vector<int> rows(inst->v1); // Rows in cache order fill the tiles around the diagonal first
+    std::sort(rows.begin(), rows.end(), [this](int a, int b) { return key[a] < key[b]; });
+    std::vector<int> rank(inst->n1);
+    for(int k = 0; k < (int)byFront.size(); k++)
+      rank[byFront[k].second] = k;
 
-    return sum / v.size();
+    double t0 = elapsed();
+    const int chunk = 64;
+    std::atomic<int> next = 0, done = 0;
+    Precomputed ret;
+    ret.blockBounds.assign(blocks.size(), 0);
+    for(int i : inst->v1)
+      ret.blockBounds[blocks.of[i]] += inst->twinCrossingsOf(i);
+    std::mutex m;
+    auto work = [&]() {
+      auto guard = cache->guard();
+      std::vector<i64> sums(blocks.size(), 0);
+      while(elapsed() - t0 < t) {
+        int r0 = next.fetch_add(chunk);
+        if(r0 >= (int)rows.size())
+          break;
+        for(int r = r0; r < std::min(r0 + chunk, (int)rows.size()); r++) {
+          int i = rows[r];
+          bool store = !cache->isFull();
+          for(int k = rank[i] + 1; k < (int)byFront.size() && byFront[k].first <= inst->bottom[i].back; k++) {
+            int j = byFront[k].second;
+            DT x;
+            if(forcedCostDiff(i, j, x)) // The minimum is 0
+              continue;
+            CostPair p = calculateCosts(i, j);
+            sums[blocks.of[i]] += std::min(p.c1, p.c2);
+            if(store && (band <= 0 || std::abs(key[i] - key[j]) <= band))
+              cache->store(key[i], key[j], p.c1 - p.c2);
+          }
+        }
+        done += std::min(chunk, (int)rows.size() - r0);
+      }
+      std::lock_guard lock(m);
+      for(int b = 0; b < blocks.size(); b++)
+        ret.blockBounds[b] += sums[b];
+    };
+
+    std::vector<std::thread> threads;
+    for(int k = 0; k < nThreads; k++)
+      threads.emplace_back(work);
+    double lastReport = elapsed();
+    while(done < (int)rows.size() && elapsed() - t0 < t) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      if(elapsed() - lastReport >= 1) {
+        lastReport = elapsed();
+        progress((double)done / rows.size());
+      }
+    }
+    for(auto &th : threads)
+      th.join();
+    for(i64 b : ret.blockBounds)
+      ret.lowerBound += b;
+    ret.done = rows.empty() ? 1.0 : (double)done / rows.size();
+    return ret;
   }
 
   void solveMedian(std::vector<int>::iterator begin, std::vector<int>::iterator end) {
@@ -126,7 +241,7 @@ public:
     std::vector<std::tuple<int,double,int>> coords;
 
     for(auto i = begin; i != end; ++i)
-      coords.push_back(std::make_tuple(median(instance.adj.at(instance.n0+*i)), average(instance.adj.at(instance.n0+*i)), *i));
+      coords.push_back(std::make_tuple(inst->bottom[*i].median, inst->bottom[*i].average, *i));
 
     std::sort(coords.begin(), coords.end());
     for(auto [_,__,i] : coords)
@@ -140,7 +255,7 @@ public:
     std::vector<std::tuple<double,int,int>> coords;
 
     for(auto i = begin; i != end; ++i)
-      coords.push_back(std::make_tuple(average(instance.adj.at(instance.n0+*i)), median(instance.adj.at(instance.n0+*i)), *i));
+      coords.push_back(std::make_tuple(inst->bottom[*i].average, inst->bottom[*i].median, *i));
 
     std::sort(coords.begin(), coords.end());
     for(auto [_,__,i] : coords)
@@ -155,7 +270,7 @@ public:
     std::uniform_int_distribution<> distrib(0,0x0fffffff);
 
     for(auto i = begin; i != end; ++i)
-      coords.push_back(std::make_tuple(average(instance.adj.at(instance.n0+*i)),
+      coords.push_back(std::make_tuple(inst->bottom[*i].average,
                                       distrib(rgen),
                                       *i));
 
@@ -164,71 +279,224 @@ public:
       *begin++ = i;
   }
 
+  // Quicksort by the cost difference with a random pivot. Above
+  // parallelSplitSize vertices (and with a task pool), the partition is done
+  // by chunks in parallel, counting the vertices that go before the pivot and
+  // scattering them to the prefix sums of the counts, and the two halves are
+  // separate tasks. The pivots come from a splitmix stream seeded by rgen, so
+  // that the order does not depend on the scheduling.
   void solveSplit(std::vector<int>::iterator begin, std::vector<int>::iterator end) {
+    auto guard = cache->guard();
+    solveSplit(begin, end, guard, rgen());
+  }
+
+  void solveSplit(std::vector<int>::iterator begin, std::vector<int>::iterator end, Guard &guard, uint64_t seed) {
     int n = end - begin;
     if(n <= 1)
       return;
-    std::uniform_int_distribution<> distrib(0,n-1);
-    auto pivot = begin + distrib(rgen);
+    if(n >= parallelSplitSize && taskPool && taskPool->size() > 0) {
+      parallelSplit(begin, end, seed);
+      return;
+    }
+    auto pivot = begin + splitmix(seed) % n;
     std::swap(*pivot, *begin);
     pivot = begin;
     auto low = begin;
-    for(auto p = begin + 1; p != end; ++p) {
-      if(costDiff(*p,*pivot) > 0) {
-        low++;
-        std::swap(*low,*p);
+    if(n < 1024) {
+      for(auto p = begin + 1; p != end; ++p) {
+        if(costDiff(*p,*pivot,guard) > 0) {
+          low++;
+          std::swap(*low,*p);
+        }
+      }
+    }
+    else {
+      Column column = this->column(*pivot, guard);
+      for(auto p = begin + 1; p != end; ++p) {
+        if(costDiff(*p,*pivot,column) > 0) {
+          low++;
+          std::swap(*low,*p);
+        }
       }
     }
     std::swap(*begin, *low);
-    solveSplit(begin, low);
-    solveSplit(low+1,end);
+    uint64_t seedLow = splitmix(seed), seedHigh = splitmix(seed);
+    solveSplit(begin, low, guard, seedLow);
+    solveSplit(low+1, end, guard, seedHigh);
   }
 
-  i64 optimizeJumpStep(std::vector<int>::iterator begin, std::vector<int>::iterator end) {
+protected:
+  void parallelSplit(std::vector<int>::iterator begin, std::vector<int>::iterator end, uint64_t seed) {
     int n = end - begin;
-    std::uniform_int_distribution<> distrib(0,n - 1);
-    int moving = distrib(rgen);
-
-    std::vector<int> besti = {moving};
-    i64 bestChange = 0;
-    i64 change = 0;
-
-    for(int t = 1; t < n; t++) {
-      if(moving + t == n) {
-        change = 0; // Reset for other direction
+    std::swap(begin[splitmix(seed) % n], *begin);
+    int pivot = *begin;
+    int nChunks = std::min(4 * (taskPool->size() + 1), n / 1024 + 1);
+    int chunk = (n - 1 + nChunks - 1) / nChunks;
+    std::vector<char> before(n);
+    std::vector<int> lows(nChunks + 1, 0); // Vertices before the pivot in each chunk, then their prefix sums
+    auto chunks = [&](auto &&f) {
+      TaskPool::Group group(*taskPool);
+      for(int c = 0; c < nChunks; c++)
+        group.run([&f, c, chunk, n]() { f(c, 1 + c * chunk, std::min(n, 1 + (c + 1) * chunk)); });
+    };
+
+    chunks([&](int c, int first, int last) {
+      auto guard = cache->guard();
+      Column column = this->column(pivot, guard);
+      for(int k = first; k < last; k++) {
+        before[k] = costDiff(begin[k], pivot, column) > 0;
+        lows[c + 1] += before[k];
       }
-      int i;
-      if(moving + t < n)
-        i = moving + t;
-      else // Go backwards: decrease i starting at moving-1
-        i = n - t - 1;
-
-      if(i > moving)
-        change += costDiff(begin[i],begin[moving]);
-      else
-        change -= costDiff(begin[i],begin[moving]);
-  ;
-      if(change > bestChange) {
-        bestChange = change;
-        besti.clear();
+    });
+    for(int c = 0; c < nChunks; c++)
+      lows[c + 1] += lows[c];
+    int nLow = lows[nChunks];
+
+    Order sorted(n);
+    sorted[nLow] = pivot;
+    chunks([&](int c, int first, int last) {
+      int low = lows[c], high = nLow + first - lows[c]; // Minus the pivot, plus itself
+      for(int k = first; k < last; k++) {
+        if(before[k])
+          sorted[low++] = begin[k];
+        else
+          sorted[high++] = begin[k];
       }
-      if(change == bestChange) {
-        besti.push_back(i);
+    });
+    std::copy(sorted.begin(), sorted.end(), begin);
+
+    uint64_t seedLow = splitmix(seed), seedHigh = splitmix(seed);
+    TaskPool::Group group(*taskPool);
+    group.run([this, begin, nLow, seedLow]() {
+      auto guard = cache->guard();
+      solveSplit(begin, begin + nLow, guard, seedLow);
+    });
+    group.run([this, begin, end, nLow, seedHigh]() {
+      auto guard = cache->guard();
+      solveSplit(begin + nLow + 1, end, guard, seedHigh);
+    });
+  }
+
+public:
+  // Gains of moving the len vertices starting at position first, as a unit,
+  // to each position that keeps the forced order: the scans stop at the first
+  // vertex that must stay on the same side of a vertex of the block. They are
+  // left in scratch().gains, the nr right moves first and then the nl left
+  // moves, both in scan order. The cost differences of each passed vertex
+  // with the block are summed by position, so that the gains are their prefix
+  // sums. Returns the best gain, or 0 if not moving is better.
+  i64 blockGains(std::vector<int>::iterator begin, std::vector<int>::iterator end, int first, int len, int &nr, int &nl) {
+    int n = end - begin;
+    auto block = begin + first, blockEnd = block + len;
+    auto stopsRight = [&](int y) {
+      return std::any_of(block, blockEnd, [this, y](int x) { return inst->forcedBefore(x, y); });
+    };
+    auto stopsLeft = [&](int y) {
+      return std::any_of(block, blockEnd, [this, y](int x) { return inst->forcedBefore(y, x); });
+    };
+
+    int hi = first + len, lo = first - 1;
+    while(hi < n && !stopsRight(begin[hi]))
+      hi++;
+    while(lo >= 0 && !stopsLeft(begin[lo]))
+      lo--;
+    nr = hi - first - len;
+    nl = first - 1 - lo;
+
+    std::vector<i64> &gains = scratch().gains;
+    gains.assign(nr + nl, 0);
+    {
+      auto guard = cache->guard();
+      for(auto x = block; x != blockEnd; ++x) {
+        if(nr + nl < shortScan) {
+          for(int k = 0; k < nr; k++)
+            gains[k] += costDiff(begin[first+len+k],*x,guard);
+          for(int k = 0; k < nl; k++)
+            gains[nr+k] -= costDiff(begin[first-1-k],*x,guard);
+          continue;
+        }
+        Column column = this->column(*x, guard);
+        for(int k = 0; k < nr; k++)
+          gains[k] += costDiff(begin[first+len+k],*x,column);
+        for(int k = 0; k < nl; k++)
+          gains[nr+k] -= costDiff(begin[first-1-k],*x,column);
       }
     }
+    return std::max({(i64)0, prefixSumMax(gains.data(), nr), prefixSumMax(gains.data() + nr, nl)});
+  }
+
+  // First position of the block after the move of index k of blockGains
+  static int gainPosition(int first, int nr, int k) {
+    return k < nr ? first + 1 + k : first - 1 - (k - nr);
+  }
 
-    std::uniform_int_distribution<> distrib2(0,besti.size()-1);
-    int choseni = besti[distrib2(rgen)];
-    if(moving <= choseni)
-      for(int i = moving; i < choseni; i++)
-        std::swap(begin[i], begin[i+1]);
-    else
-      for(int i = moving; i > choseni; i--)
-        std::swap(begin[i], begin[i-1]);
+  static void placeBlock(std::vector<int>::iterator begin, int first, int len, int chosen) {
+    auto block = begin + first, blockEnd = block + len;
+    if(first < chosen)
+      std::rotate(block, blockEnd, blockEnd + (chosen - first));
+    else if(first > chosen)
+      std::rotate(begin + chosen, block, blockEnd);
+  }
 
+  // Moves the len vertices starting at position first, as a unit, to the
+  // position with the fewest crossings (see blockGains). Ties are broken at
+  // random, and include not moving only if sideways moves are allowed. The
+  // new first position is stored in chosen.
+  i64 moveBlock(std::vector<int>::iterator begin, std::vector<int>::iterator end, int first, int len, bool sideways, int &chosen) {
+    int nr, nl;
+    i64 bestChange = blockGains(begin, end, first, len, nr, nl);
+    const std::vector<i64> &gains = scratch().gains;
+
+    chosen = first;
+    if(bestChange == 0 && !sideways)
+      return 0;
+    int ties = bestChange == 0; // Staying
+    for(i64 g : gains)
+      ties += g == bestChange;
+    std::uniform_int_distribution<> distrib(0,ties-1);
+    int pick = distrib(rgen) - (bestChange == 0);
+    for(int k = 0; pick >= 0; k++) {
+      if(gains[k] == bestChange && pick-- == 0)
+        chosen = gainPosition(first, nr, k);
+    }
+    placeBlock(begin, first, len, chosen);
     return bestChange;
   }
 
+  i64 jumpVertex(std::vector<int>::iterator begin, std::vector<int>::iterator end, int moving, bool sideways, int &choseni) {
+    return moveBlock(begin, end, moving, 1, sideways, choseni);
+  }
+
+  // Jump of a random vertex, with sideways moves to leave plateaus
+  i64 optimizeJumpStep(std::vector<int>::iterator begin, std::vector<int>::iterator end) {
+    std::uniform_int_distribution<> distrib(0,end - begin - 1);
+    int choseni;
+    return jumpVertex(begin, end, distrib(rgen), true, choseni);
+  }
+
+  // Improving jumps of the positions marked in look, until none is left or
+  // the time runs out. Only the positions around a move are marked again.
+  i64 optimizeJump(std::vector<int>::iterator begin, std::vector<int>::iterator end, DontLook &look, double t = std::numeric_limits<double>::infinity()) {
+    i64 ret = 0;
+    double t0 = elapsed();
+    for(int k = 0; ; k++) {
+      if(k % 256 == 255 && elapsed() - t0 > t)
+        break;
+      int moving = look.next();
+      if(moving < 0)
+        break;
+      int choseni;
+      i64 improvement = jumpVertex(begin, end, moving, false, choseni);
+      if(improvement > 0) {
+        look.changed(std::min(moving, choseni), std::max(moving, choseni) + 1);
+        ret += improvement;
+      }
+    }
+    return ret;
+  }
+
+  // Random jumps, including sideways ones, which help the slices more than
+  // converging with the don't-look bits
   i64 optimizeJump(std::vector<int>::iterator begin, std::vector<int>::iterator end) {
     int n = end - begin;
     i64 ret = 0;
@@ -253,47 +521,319 @@ public:
     return ret;
   }
 
-  i64 timedOptimizeJump(std::vector<int>::iterator begin, std::vector<int>::iterator end, double t) {
+  // Improving jumps of the marked positions for at most t seconds. Returns as
+  // soon as look converges, so that the caller can spend the rest of the time
+  // on other operators instead of scanning positions known to have no
+  // improving jump.
+  i64 timedOptimizeJump(std::vector<int>::iterator begin, std::vector<int>::iterator end, double t, DontLook &look) {
+    if(look.size() != end - begin)
+      look.reset(end - begin);
+    return optimizeJump(begin, end, look, t);
+  }
+
+  // Moves random blocks of 2 to maxBlockMove vertices for at most t seconds.
+  // A run of vertices may have to move together, when moving any one of them
+  // alone makes it worse.
+  i64 timedOptimizeBlockMove(std::vector<int>::iterator begin, std::vector<int>::iterator end, double t, DontLook &look) {
+    int n = end - begin;
+    if(n < 3)
+      return 0;
+    std::uniform_int_distribution<> lendist(2,std::min(maxBlockMove, n - 1));
     i64 improvement = 0;
     double t0 = elapsed();
-    while(elapsed() - t0 <= t)
-      improvement += optimizeJumpStep(begin, end);
+    while(elapsed() - t0 <= t) {
+      int len = lendist(rgen);
+      int first = std::uniform_int_distribution<>(0,n - len)(rgen), chosen;
+      improvement += moveBlock(begin, end, first, len, true, chosen);
+      if(chosen != first)
+        look.changed(std::min(first, chosen), std::max(first, chosen) + len);
+    }
+    return improvement;
+  }
 
+  // Simulated annealing by jumps for at most t seconds. A random vertex jumps
+  // to a position of its scan (see blockGains), or stays, with a probability
+  // proportional to exp(gain / T) (heat bath), where T is the temperature
+  // times the average absolute cost difference of adjacent vertices. The
+  // jumps since the best order seen are logged, and undone at the end, so
+  // that the order left is the best one. Returns its improvement.
+  i64 anneal(std::vector<int>::iterator begin, std::vector<int>::iterator end, double t, double temperature) {
+    int n = end - begin;
+    if(n < 2 || temperature <= 0)
+      return 0;
+    double scale = 0;
+    {
+      auto guard = cache->guard();
+      int samples = std::min(n - 1, 1024);
+      std::uniform_int_distribution<> posdist(0,n - 2);
+      for(int s = 0; s < samples; s++) {
+        int k = posdist(rgen);
+        scale += std::abs((double)costDiff(begin[k], begin[k+1], guard));
+      }
+      scale /= samples;
+    }
+    double T = temperature * std::max(scale, 1.0);
+
+    Scratch &sc = scratch();
+    sc.moves.clear();
+    std::uniform_int_distribution<> movingdist(0,n - 1);
+    std::uniform_real_distribution<> unit(0,1);
+    i64 gain = 0, bestGain = 0;
+    double t0 = elapsed();
+    for(int k = 0; ; k++) {
+      if(k % 64 == 63 && elapsed() - t0 > t)
+        break;
+      int moving = movingdist(rgen), nr, nl;
+      i64 top = blockGains(begin, end, moving, 1, nr, nl);
+      double stay = std::exp(-top / T), sum = stay;
+      sc.weights.resize(nr + nl);
+      for(int p = 0; p < nr + nl; p++)
+        sum += sc.weights[p] = std::exp((sc.gains[p] - top) / T);
+      double r = unit(rgen) * sum - stay;
+      int p = 0;
+      for(; r >= 0 && p < nr + nl; p++)
+        r -= sc.weights[p];
+      if(p-- == 0) // Stays
+        continue;
+
+      int chosen = gainPosition(moving, nr, p);
+      placeBlock(begin, moving, 1, chosen);
+      gain += sc.gains[p];
+      sc.moves.emplace_back(moving, chosen);
+      if(gain > bestGain) {
+        bestGain = gain;
+        sc.moves.clear();
+      }
+    }
+
+    for(auto m = sc.moves.rbegin(); m != sc.moves.rend(); ++m)
+      placeBlock(begin, m->second, 1, m->first);
+    return bestGain;
+  }
+
+  // Path relinking from the order at begin towards guide, an order of the
+  // same vertices, for at most t seconds. From left to right, each vertex of
+  // guide jumps to its position in guide, with a gain summed from the matrix,
+  // for at most depth times the number of vertices out of place (so that the
+  // result stays away from guide if depth < 1). The order is left at the best
+  // of the orders passed strictly between the two ends, which recombines them
+  // even when both are local optima, and its improvement (maybe negative) is
+  // returned. Nothing changes if there is no order between them on the way.
+  i64 relink(std::vector<int>::iterator begin, std::vector<int>::iterator end, const Order &guide, double depth, double t) {
+    int n = end - begin;
+    Scratch &sc = scratch();
+    sc.pos.resize(inst->n1);
+    int maxMoves = 0;
+    for(int k = 0; k < n; k++) {
+      sc.pos[begin[k]] = k;
+      maxMoves += begin[k] != guide[k];
+    }
+    maxMoves = std::ceil(depth * maxMoves);
+    sc.moves.clear();
+    // After the first move, the first vertex out of place never moves back,
+    // so the order differs from the start
+    i64 gain = 0, bestGain = std::numeric_limits<i64>::min();
+    int moved = 0;
+    double t0 = elapsed();
+    auto guard = cache->guard();
+    for(int k = 0; k < n; k++) {
+      if(begin[k] == guide[k])
+        continue;
+      if(moved > 0 && gain > bestGain) { // Not guide, which differs at k
+        bestGain = gain;
+        sc.moves.clear();
+      }
+      if(moved == maxMoves || (++moved % 64 == 0 && elapsed() - t0 > t))
+        break;
+      int v = guide[k], p = sc.pos[v];
+      Column column = this->column(v, guard);
+      for(int j = k; j < p; j++)
+        gain -= costDiff(begin[j], v, column);
+      std::rotate(begin + k, begin + p, begin + p + 1);
+      for(int j = k; j <= p; j++)
+        sc.pos[begin[j]] = j;
+      sc.moves.emplace_back(p, k);
+    }
+    if(moved > 0 && gain > bestGain && !std::equal(begin, end, guide.begin())) {
+      bestGain = gain;
+      sc.moves.clear();
+    }
+
+    for(auto m = sc.moves.rbegin(); m != sc.moves.rend(); ++m)
+      placeBlock(begin, m->second, 1, m->first);
+    return bestGain == std::numeric_limits<i64>::min() ? 0 : bestGain;
+  }
+
+  // Optimal order of the k vertices at first, by dynamic programming over the
+  // subsets placed first. Placing vertex j after a subset S inverts j with the
+  // vertices of S that came after it, so the cost of the transition is the sum
+  // of their cost differences with j. These sums are read from two tables per
+  // vertex, for the low and the high half of the bits of S. Subsets that miss
+  // a vertex forced before j cannot be followed by j. The order is changed
+  // only if it improves.
+  i64 optimizeWindow(std::vector<int>::iterator first, int k) {
+    Scratch &sc = scratch();
+    const i64 inf = std::numeric_limits<i64>::max();
+    int h = k / 2, nLow = 1 << h, nHigh = 1 << (k - h), stride = nLow + nHigh;
+    uint32_t full = (1u << k) - 1;
+    sc.half.assign(k * stride, 0);
+    uint32_t pred[maxWindow];
+    {
+      auto guard = cache->guard();
+      for(int j = 0; j < k; j++) {
+        i64 *low = sc.half.data() + j * stride, *high = low + nLow;
+        pred[j] = 0;
+        for(int i = 0; i < k; i++) {
+          if(inst->forcedBefore(first[i], first[j]))
+            pred[j] |= 1u << i;
+        }
+        // Only the vertices after j cost something when placed before it
+        for(int i = j + 1; i < k; i++) {
+          i64 c = costDiff(first[j], first[i], guard);
+          if(i < h)
+            low[1 << i] = c;
+          else
+            high[1 << (i - h)] = c;
+        }
+        for(int m = 1; m < nLow; m++)
+          low[m] = low[m & (m - 1)] + low[m & -m];
+        for(int m = 1; m < nHigh; m++)
+          high[m] = high[m & (m - 1)] + high[m & -m];
+      }
+    }
+
+    sc.dp.assign(full + 1, inf);
+    sc.last.resize(full + 1);
+    sc.dp[0] = 0;
+    for(uint32_t s = 0; s < full; s++) {
+      i64 base = sc.dp[s];
+      if(base == inf)
+        continue;
+      const i64 *row = sc.half.data();
+      uint32_t lowS = s & (nLow - 1), highS = s >> h;
+      for(int j = 0; j < k; j++, row += stride) {
+        uint32_t t = s | (1u << j);
+        if(t == s || (pred[j] & ~s))
+          continue;
+        i64 c = base + row[lowS] + row[nLow + highS];
+        if(c < sc.dp[t]) {
+          sc.dp[t] = c;
+          sc.last[t] = j;
+        }
+      }
+    }
+
+    i64 delta = sc.dp[full];
+    if(delta >= 0)
+      return 0;
+    int order[maxWindow];
+    for(int pos = k - 1, s = full; pos >= 0; pos--) {
+      order[pos] = first[sc.last[s]];
+      s ^= 1u << sc.last[s];
+    }
+    std::copy(order, order + k, first);
+    return -delta;
+  }
+
+  // Sweeps windows of k vertices overlapping by half, from a random start and
+  // wrapping around, for at most t seconds. Stops early once a whole sweep
+  // finds nothing, and then no window of the sweep can be improved.
+  i64 timedOptimizeWindows(std::vector<int>::iterator begin, std::vector<int>::iterator end, int k, double t, DontLook &look) {
+    int n = end - begin;
+    k = std::min({k, n, maxWindow});
+    if(k < 3)
+      return 0;
+    int step = std::max(1, k / 2), nWindows = (n - k + step - 1) / step + 1;
+    int w = std::uniform_int_distribution<>(0,nWindows - 1)(rgen);
+    i64 improvement = 0;
+    double t0 = elapsed();
+    for(int unchanged = 0; unchanged < nWindows && elapsed() - t0 <= t; unchanged++) {
+      int first = std::min(w * step, n - k);
+      i64 delta = optimizeWindow(begin + first, k);
+      if(delta > 0) {
+        look.changed(first, first + k);
+        improvement += delta;
+        unchanged = -1;
+      }
+      w = w + 1 == nWindows ? 0 : w + 1;
+    }
     return improvement;
   }
 
-  i64 optimizeSlice(std::vector<int>::iterator begin, std::vector<int>::iterator end, bool jump) {
+  // Change in the number of crossings when the vertices of [oldBegin,oldEnd)
+  // are reordered as in curBegin. Every pair whose order is inverted changes
+  // the crossings by its cost difference, so the inverted pairs are
+  // enumerated by an insertion sort, unless there are too many of them
+  // compared to the edges, in which case both orders are recounted.
+  i64 reorderDelta(std::vector<int>::iterator oldBegin, std::vector<int>::iterator oldEnd, std::vector<int>::iterator curBegin) {
+    Scratch &sc = scratch();
+    int n = oldEnd - oldBegin;
+    sc.pos.resize(inst->n1);
+    sc.seq.resize(n);
+    sc.tmp.resize(n);
+    i64 edges = 0;
+    for(int k = 0; k < n; k++)
+      sc.pos[curBegin[k]] = k;
+    for(int k = 0; k < n; k++) {
+      sc.seq[k] = sc.pos[oldBegin[k]];
+      edges += inst->bottom[oldBegin[k]].degree;
+    }
+
+    if(sortInversions(sc.seq.data(), sc.tmp.data(), n) > maxInversionsPerEdge * edges)
+      return crossings(*inst, curBegin, curBegin + n) - crossings(*inst, oldBegin, oldEnd);
+
+    for(int k = 0; k < n; k++)
+      sc.seq[k] = sc.pos[oldBegin[k]];
+    auto guard = cache->guard();
+    i64 delta = 0;
+    for(int l = 1; l < n; l++) {
+      int p = sc.seq[l], k = l;
+      for(; k > 0 && sc.seq[k-1] > p; k--) {
+        delta += costDiff(curBegin[sc.seq[k-1]], curBegin[p], guard);
+        sc.seq[k] = sc.seq[k-1];
+      }
+      sc.seq[k] = p;
+    }
+    return delta;
+  }
+
+  // Splits the vertices within radius of a random center again (with jumps if
+  // jump), and keeps the result if it is not worse. The radius is random if
+  // 0. The changed positions are marked in look, if given.
+  i64 optimizeSlice(std::vector<int>::iterator begin, std::vector<int>::iterator end, bool jump, DontLook *look = nullptr, int radius = 0) {
     i64 improvement = 0;
-    std::uniform_int_distribution<> radiusdist(8,18);
-    if(!jump)
-      radiusdist = std::uniform_int_distribution<>(8,30);
-    int radius = radiusdist(rgen);
-    radius = radius * radius;
+    if(radius == 0) {
+      std::uniform_int_distribution<> radiusdist(8,18);
+      if(!jump)
+        radiusdist = std::uniform_int_distribution<>(8,30);
+      radius = radiusdist(rgen);
+      radius = radius * radius;
+    }
 
     std::uniform_int_distribution<> centerdist(0,end - begin - 1);
     int center = centerdist(rgen);
-    Order s(begin + std::max(0, center - radius),
-            std::min(end, begin + center + radius));
-    i64 crs = crossings(instance, s.begin(), s.end());
+    auto first = begin + std::max(0, center - radius);
+    auto last = std::min(end, begin + center + radius);
+    Order &s = scratch().slice;
+    s.assign(first, last);
 
     solveSplit(s.begin(), s.end());
 
-    i64 crs2 = crossings(instance, s.begin(), s.end());
+    i64 delta = reorderDelta(first, last, s.begin());
     if(jump) {
       while(true) {
-        i64 delta = optimizeJump(s.begin(), s.end());
-        if(delta == 0)
+        i64 jumpDelta = optimizeJump(s.begin(), s.end());
+        if(jumpDelta == 0)
           break;
-        crs2 -= delta;
+        delta -= jumpDelta;
       }
     }
 
-    if(crs2 <= crs) {
-      for(auto sit = s.begin(), it = begin + std::max(0, center - radius);
-          sit != s.end(); ++it, ++sit) {
-        *it = *sit;
-      }
-      improvement = crs - crs2;
+    if(delta <= 0) {
+      if(look && !std::equal(s.begin(), s.end(), first))
+        look->changed(first - begin, last - begin);
+      std::copy(s.begin(), s.end(), first);
+      improvement = -delta;
     }
 
     return improvement;
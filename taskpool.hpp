@@ -0,0 +1,111 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fork-join tasks on a fixed set of threads, started once. The thread that
+// waits for a group runs queued tasks meanwhile (of any group, oldest first),
+// so tasks can spawn and wait for other tasks without deadlock, and a pool
+// without threads simply runs everything in the calling thread.
+class TaskPool {
+  std::mutex m;
+  std::condition_variable cv;
+  std::deque<std::function<void()>> tasks;
+  std::vector<std::thread> threads;
+  bool stopping = false;
+
+public:
+  class Group {
+    TaskPool &pool;
+    std::atomic<int> pending = 0;
+
+  public:
+    Group(TaskPool &_pool) : pool(_pool) {}
+
+    ~Group() {
+      wait();
+    }
+
+    void run(std::function<void()> f) {
+      if(pool.size() == 0) {
+        f();
+        return;
+      }
+      pending++;
+      pool.push([this, f = std::move(f)]() {
+        f();
+        pending--;
+      });
+    }
+
+    void wait() {
+      while(pending > 0)
+        if(!pool.runOne())
+          std::this_thread::yield();
+    }
+  };
+
+  // nThreads threads besides the ones waiting for groups
+  TaskPool(int nThreads) {
+    for(int k = 0; k < nThreads; k++) {
+      threads.emplace_back([this]() {
+        while(true) {
+          std::function<void()> f;
+          {
+            std::unique_lock lock(m);
+            cv.wait(lock, [this]() { return stopping || !tasks.empty(); });
+            if(tasks.empty())
+              return;
+            f = std::move(tasks.front());
+            tasks.pop_front();
+          }
+          f();
+        }
+      });
+    }
+  }
+
+  ~TaskPool() {
+    {
+      std::lock_guard lock(m);
+      stopping = true;
+    }
+    cv.notify_all();
+    for(auto &t : threads)
+      t.join();
+  }
+
+  int size() const {
+    return threads.size();
+  }
+
+  // Runs one queued task in the calling thread, if there is one
+  bool runOne() {
+    std::function<void()> f;
+    {
+      std::lock_guard lock(m);
+      if(tasks.empty())
+        return false;
+      f = std::move(tasks.front());
+      tasks.pop_front();
+    }
+    f();
+    return true;
+  }
+
+protected:
+  void push(std::function<void()> f) {
+    {
+      std::lock_guard lock(m);
+      tasks.push_back(std::move(f));
+    }
+    cv.notify_one();
+  }
+};
+
+// Pool of the parallel operators (solveSplit and the initial solutions), if set
+inline TaskPool *taskPool = nullptr;
@@ -0,0 +1,190 @@
+#pragma once
+#include "opstats.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// JSON-lines trace of the progress, to plot anytime curves and watch runs.
+// Improvements are only queued by the threads that find them (dropped if the
+// writer falls behind), and a background thread writes them every period
+// seconds, followed by a sample of the global state from the sampler, which
+// also serves as a heartbeat when nothing improves. The destination is a
+// file, or a Unix socket for "unix:path". Writes to the socket never block:
+// the lines that a slow reader has no room for are dropped and counted.
+class Trace {
+  struct Event {
+    double time;
+    i64 crossings;
+    int block, nbest; // Block that improved, by the position of its first vertex
+    const char *op;
+  };
+  static constexpr size_t maxPending = 1 << 16;
+
+  std::mutex m; // Protects the events
+  std::condition_variable cv;
+  std::vector<Event> pending;
+  size_t dropped = 0;
+  bool stopping = false;
+  bool ended = false; // The end line was written
+  std::mutex writing; // Protects the output
+  int fd = -1;
+  bool socket = false;
+  std::string partial; // Rest of a line that the reader had no room for
+  std::thread writer;
+  std::function<std::string()> sampler;
+
+public:
+  ~Trace() {
+    finish();
+  }
+
+  bool open(const std::string &dest) {
+    if(dest.rfind("unix:", 0) == 0) {
+      sockaddr_un addr{};
+      addr.sun_family = AF_UNIX;
+      std::string path = dest.substr(5);
+      if(path.size() >= sizeof(addr.sun_path))
+        return false;
+      std::copy(path.begin(), path.end(), addr.sun_path);
+      fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+      socket = true;
+      if(fd >= 0 && connect(fd, (sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        fd = -1;
+      }
+    }
+    else
+      fd = ::open(dest.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    return fd >= 0;
+  }
+
+  bool active() const {
+    return fd >= 0;
+  }
+
+  // The sampler returns the fields of the sample lines, without braces
+  void start(double period, std::function<std::string()> _sampler) {
+    if(!active())
+      return;
+    sampler = _sampler;
+    writer = std::thread([this, period]() {
+      while(true) {
+        std::vector<Event> events;
+        size_t lost;
+        bool stop;
+        {
+          std::unique_lock lock(m);
+          cv.wait_for(lock, std::chrono::duration<double>(period), [this]() {
+            return stopping || pending.size() >= maxPending / 2;
+          });
+          events.swap(pending);
+          lost = dropped;
+          stop = stopping;
+        }
+        std::string out = lines(events, stop ? "end" : "sample", lost);
+        {
+          std::lock_guard lock(writing);
+          output(out);
+        }
+        if(stop)
+          return;
+      }
+    });
+  }
+
+  // Called by the thread that improved the best solution of a block, with
+  // the new total crossings and the solutions of that block as good as its best
+  void improved(i64 crossings, int block, int nbest) {
+    if(!active())
+      return;
+    std::lock_guard lock(m);
+    if(pending.size() < maxPending)
+      pending.push_back({elapsed(), crossings, block, nbest, improvingOperator});
+    else
+      dropped++;
+  }
+
+  // Stops the writer, which writes what is left and the end line, so that
+  // nothing follows it. Called once before the program exits.
+  void finish() {
+    if(ended)
+      return;
+    ended = true;
+    if(writer.joinable()) {
+      {
+        std::lock_guard lock(m);
+        stopping = true;
+      }
+      cv.notify_one();
+      writer.join();
+    }
+    else if(active()) { // Not started yet
+      std::vector<Event> events;
+      size_t lost;
+      {
+        std::lock_guard lock(m);
+        events.swap(pending);
+        lost = dropped;
+      }
+      std::lock_guard lock(writing);
+      output(lines(events, "end", lost));
+    }
+  }
+
+protected:
+  std::string lines(const std::vector<Event> &events, const char *kind, size_t lost) {
+    std::string out;
+    char buf[256];
+    for(const Event &e : events) {
+      snprintf(buf, sizeof(buf), "{\"t\":%.3f,\"event\":\"improved\",\"crossings\":%lld,\"block\":%d,\"nbest\":%d,\"op\":\"%s\"}\n",
+               e.time, e.crossings, e.block, e.nbest, e.op);
+      out += buf;
+    }
+    snprintf(buf, sizeof(buf), "{\"t\":%.3f,\"event\":\"%s\",\"dropped\":%zu", elapsed(), kind, lost);
+    out += buf;
+    if(sampler)
+      out += "," + sampler();
+    out += "}\n";
+    return out;
+  }
+
+  // Stops tracing if the reader went away. If the socket is full, the line
+  // being sent is finished at the next call and the others are dropped.
+  void output(const std::string &out) {
+    std::string data = partial + out;
+    partial.clear();
+    for(size_t done = 0; fd >= 0 && done < data.size(); ) {
+      ssize_t w = socket ? send(fd, data.data() + done, data.size() - done, MSG_NOSIGNAL | MSG_DONTWAIT)
+                         : write(fd, data.data() + done, data.size() - done);
+      if(w < 0 && socket && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        size_t from = done;
+        if(done > 0 && data[done - 1] != '\n') {
+          from = data.find('\n', done) + 1;
+          partial = data.substr(done, from - done);
+        }
+        std::lock_guard lock(m);
+        dropped += std::count(data.begin() + from, data.end(), '\n');
+        return;
+      }
+      if(w <= 0) {
+        close(fd);
+        fd = -1;
+      }
+      else
+        done += w;
+    }
+  }
+};
+
+inline Trace trace;
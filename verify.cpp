@@ -0,0 +1,57 @@
+// Counts the crossings of a solution using all cores
+//   ./verify instance.gr solution.sol [segtree|fenwick|mergesort]
+#include "instance.hpp"
+#include "solution.hpp"
+#include <cstring>
+
+int main(int argc, char **argv) {
+  if(argc < 3) {
+    std::cerr << "Usage: " << argv[0] << " instance.gr solution.sol [segtree|fenwick|mergesort]" << std::endl;
+    return 1;
+  }
+
+  crossingEngine = CrossingEngine::MergeSort;
+  crossingThreads = std::max(1u, std::thread::hardware_concurrency());
+  if(argc >= 4) {
+    if(!strcmp(argv[3], "segtree"))
+      crossingEngine = CrossingEngine::Segtree;
+    else if(!strcmp(argv[3], "fenwick"))
+      crossingEngine = CrossingEngine::Fenwick;
+    else if(strcmp(argv[3], "mergesort")) {
+      std::cerr << "Unknown engine " << argv[3] << std::endl;
+      return 1;
+    }
+  }
+
+  // Instance reads the standard input and load returns an empty order when
+  // the files cannot be opened
+  for(int k = 1; k <= 2; k++) {
+    if(!std::ifstream(argv[k])) {
+      std::cerr << "Cannot open " << argv[k] << std::endl;
+      return 1;
+    }
+  }
+
+  Instance inst(argv[1]);
+  Order order = load(inst, argv[2]);
+  double t = elapsed();
+
+  // The solution must be a permutation of the bottom vertices
+  std::vector<char> seen(inst.n1, 0);
+  for(int v : order) {
+    if(v < 0 || v >= inst.n1 || seen[v]) {
+      std::cerr << "Invalid solution: vertex " << v + inst.n0 + 1 << (v < 0 || v >= inst.n1 ? " is not a bottom vertex" : " is listed twice") << std::endl;
+      return 1;
+    }
+    seen[v] = 1;
+  }
+  if((int)order.size() != inst.n1) {
+    std::cerr << "Invalid solution: " << inst.n1 - order.size() << " bottom vertices are missing" << std::endl;
+    return 1;
+  }
+
+  i64 cr = crossings(inst, order.begin(), order.end());
+  std::cerr << "Counted in " << elapsed() - t << " seconds (read in " << t << " seconds)" << std::endl;
+  std::cout << cr << std::endl;
+  return 0;
+}
@@ -0,0 +1,83 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+// Work-stealing queue of solution indices. Each worker owns a lane: it takes
+// work from the back of its own lane and, when it runs dry, steals from the
+// front of the other lanes. Every index lives in at most one lane, so a
+// solution is never improved by two workers at the same time.
+class WorkQueue {
+  struct Lane {
+    std::mutex m;
+    std::deque<int> items;
+  };
+  std::vector<Lane> lanes;
+  std::mutex waitMutex; // For the workers waiting in wait
+  std::condition_variable pushed;
+
+public:
+  WorkQueue(int nWorkers) : lanes(nWorkers) {}
+
+  int size() const {
+    return lanes.size();
+  }
+
+  // Work that should be continued soon (e.g. a solution that just improved)
+  void pushBack(int w, int item) {
+    {
+      std::lock_guard lock(lanes[w].m);
+      lanes[w].items.push_back(item);
+    }
+    notify();
+  }
+
+  // Work that can wait and is the first to be stolen
+  void pushFront(int w, int item) {
+    {
+      std::lock_guard lock(lanes[w].m);
+      lanes[w].items.push_front(item);
+    }
+    notify();
+  }
+
+  bool pop(int w, int &item) {
+    {
+      std::lock_guard lock(lanes[w].m);
+      if(!lanes[w].items.empty()) {
+        item = lanes[w].items.back();
+        lanes[w].items.pop_back();
+        return true;
+      }
+    }
+
+    for(int k = 1; k < size(); k++) {
+      Lane &victim = lanes[(w + k) % size()];
+      std::lock_guard lock(victim.m);
+      if(!victim.items.empty()) {
+        item = victim.items.front();
+        victim.items.pop_front();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Same as pop, but waits up to t seconds for an item to be pushed
+  bool wait(int w, int &item, double t) {
+    if(pop(w, item))
+      return true;
+    std::unique_lock lock(waitMutex);
+    return pushed.wait_for(lock, std::chrono::duration<double>(t), [&]() { return pop(w, item); });
+  }
+
+protected:
+  void notify() {
+    { // A worker between its last pop and its wait holds waitMutex
+      std::lock_guard lock(waitMutex);
+    }
+    pushed.notify_one();
+  }
+};